@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+#
+# Converts the traffic captured by hid-logitech-dj (capture_kb) into a
+# hid-replay trace, or dumps it as text.
+#
+# Usage, with the receiver being 0003:046D:C52B.0003:
+#
+#   echo 1 > /sys/kernel/debug/hid-logitech-dj/0003:046D:C52B.0003/capture_enable
+#   ... reproduce the problem ...
+#   echo 0 > /sys/kernel/debug/hid-logitech-dj/0003:046D:C52B.0003/capture_enable
+#   cat /sys/kernel/debug/hid-logitech-dj/0003:046D:C52B.0003/capture* > trace.bin
+#   ./dj-capture-to-replay.py \
+#       --rdesc /sys/bus/hid/devices/0003:046D:C52B.0003/report_descriptor \
+#       trace.bin > trace.hid
+#
+# The record layout is struct dj_capture_record in hid-logitech-dj.h.
+
+import argparse
+import struct
+import sys
+
+RECORD = struct.Struct('<QBBB5x32s')
+
+DIRECTIONS = ['in', 'out']
+ROUTES = ['none', 'driver', 'device', 'receiver', 'dropped']
+
+
+def read_records(paths):
+    records = []
+    for path in paths:
+        with open(path, 'rb') as f:
+            buf = f.read()
+        for offset in range(0, len(buf) - RECORD.size + 1, RECORD.size):
+            timestamp, direction, route, size, data = \
+                RECORD.unpack_from(buf, offset)
+            # relay pads the end of the sub-buffers with zeroes
+            if not timestamp and not size:
+                continue
+            records.append((timestamp, direction, route,
+                            data[:min(size, len(data))]))
+    records.sort(key=lambda r: r[0])
+    return records
+
+
+def hexdump(data):
+    return ' '.join('%02x' % b for b in data)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Convert hid-logitech-dj captures to hid-replay traces")
+    parser.add_argument('captures', nargs='+',
+                        help='capture files (capture0, capture1, ...)')
+    parser.add_argument('--rdesc',
+                        help='report descriptor of the receiver interface')
+    parser.add_argument('--name', default='Logitech USB Receiver')
+    parser.add_argument('--id', default='3 046d c52b',
+                        help='"bus vendor product" of the replayed device')
+    parser.add_argument('--text', action='store_true',
+                        help='dump all the records instead of a hid-replay '
+                             'trace')
+    args = parser.parse_args()
+
+    records = read_records(args.captures)
+    if not records:
+        return 0
+
+    out = sys.stdout
+    start = records[0][0]
+
+    if args.text:
+        for timestamp, direction, route, data in records:
+            out.write('%12.6f %-3s %-8s %s\n' % (
+                (timestamp - start) / 1e9,
+                DIRECTIONS[direction] if direction < len(DIRECTIONS)
+                else direction,
+                ROUTES[route] if route < len(ROUTES) else route,
+                hexdump(data)))
+        return 0
+
+    if args.rdesc:
+        with open(args.rdesc, 'rb') as f:
+            rdesc = f.read()
+        out.write('R: %d %s\n' % (len(rdesc), hexdump(rdesc)))
+    out.write('N: %s\n' % args.name)
+    out.write('I: %s\n' % args.id)
+
+    # Only what the receiver sent can be replayed
+    for timestamp, direction, route, data in records:
+        if direction != 0:
+            continue
+        delta = timestamp - start
+        out.write('E: %06d.%06d %d %s\n' % (
+            delta // 1000000000, (delta % 1000000000) // 1000,
+            len(data), hexdump(data)))
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,583 @@
+#!/usr/bin/env python3
+#
+# Emulates a Unifying receiver through uhid for hid-logitech-dj, replays
+# input reports to it at a configurable rate and measures their delivery
+# to evdev.
+#
+# Usage, as root with uhid and hid-logitech-dj loaded:
+#
+#   ./dj-replay.py --trace trace.hid --speed 2
+#   ./dj-replay.py --device 2:4013:4 --rate 1000 --count 10000
+#   ./dj-replay.py --stress 600 --receivers 2
+#
+# Traces are hid-replay ones, as written by dj-capture-to-replay.py. The
+# devices paired to the emulated receiver are the ones announced by the
+# pairing notifications of the trace, which are answered to the query of
+# the driver instead of being replayed, or the ones given with --device
+# (index:wpid:reports, in hex, reports being the bitfield of report types
+# of struct dj_report). The HID++ requests of the driver are failed, so
+# the devices come up without names.
+#
+# The latency is measured from the write() of a report to the uhid node to
+# the evdev timestamp of the frame it produced, both CLOCK_MONOTONIC. A
+# frame is matched to the last report written before it, so the figures
+# only hold while the reports are delivered as fast as they are written;
+# compare the frame count with the report count.
+#
+# --stress drives the receivers with random pairing, unpairing, connection
+# status and input reports instead, and prints the event throughput, the
+# time from a pairing to the input node of the device (sampled every
+# 10 ms, not measured in aggregate mode), the children left once every
+# device is unpaired and the growth of the kernel memory. Notifications
+# dropped by the driver show as "kfifo full" in the kernel log.
+
+import argparse
+import bisect
+import ctypes
+import errno
+import fcntl
+import math
+import os
+import random
+import select
+import struct
+import sys
+import threading
+import time
+
+UHID_CREATE = 0
+UHID_DESTROY = 1
+UHID_OUTPUT = 6
+UHID_INPUT = 8
+UHID_GET_REPORT = 9
+UHID_GET_REPORT_REPLY = 10
+UHID_SET_REPORT = 13
+UHID_SET_REPORT_REPLY = 14
+UHID_DATA_MAX = 4096
+UHID_EVENT_MAX = 8192
+
+BUS_USB = 0x03
+VENDOR_LOGITECH = 0x046d
+PRODUCT_UNIFYING = 0xc52b
+
+REPORT_ID_HIDPP_SHORT = 0x10
+REPORT_ID_HIDPP_LONG = 0x11
+REPORT_ID_DJ_SHORT = 0x20
+DJREPORT_SHORT_LENGTH = 15
+HIDPP_ERROR = 0x8f
+HIDPP_ERR_INVALID_ADDRESS = 0x02
+
+REPORT_TYPE_KEYBOARD = 0x01
+REPORT_TYPE_MOUSE = 0x02
+REPORT_TYPE_CMD_GET_PAIRED_DEVICES = 0x81
+REPORT_TYPE_NOTIF_DEVICE_PAIRED = 0x41
+REPORT_TYPE_NOTIF_DEVICE_UNPAIRED = 0x40
+REPORT_TYPE_NOTIF_CONNECTION_STATUS = 0x42
+SPFUNCTION_DEVICE_LIST_EMPTY = 0x02
+STATUS_LINKLOSS = 0x01
+STD_KEYBOARD = 1 << REPORT_TYPE_KEYBOARD
+STD_MOUSE = 1 << REPORT_TYPE_MOUSE
+MULTIMEDIA = 1 << 0x03
+POWER_KEYS = 1 << 0x04
+MEDIA_CENTER = 1 << 0x08
+KBD_LEDS = 1 << 0x0e
+
+DJ_DEVICE_INDEX_MIN = 1
+DJ_DEVICE_INDEX_MAX = 6
+
+# Devices --stress pairs: a mouse and a keyboard with consumer keys
+STRESS_DEVICES = [
+    (0x4013, STD_MOUSE),
+    (0x2011, STD_KEYBOARD | MULTIMEDIA | POWER_KEYS | MEDIA_CENTER |
+     KBD_LEDS),
+]
+
+EV_SYN = 0x00
+SYN_REPORT = 0x00
+INPUT_EVENT = struct.Struct('llHHi')
+EVIOCSCLOCKID = 0x400445a0
+CLOCK_MONOTONIC = 1
+
+# Report descriptor of the DJ interface of a c52b receiver: HID++ short
+# and long reports, then DJ short and long reports
+RECEIVER_RDESC = bytes([
+    0x06, 0x00, 0xff, 0x09, 0x01, 0xa1, 0x01, 0x85, 0x10, 0x75, 0x08,
+    0x95, 0x06, 0x15, 0x00, 0x26, 0xff, 0x00, 0x09, 0x01, 0x81, 0x00,
+    0x09, 0x01, 0x91, 0x00, 0xc0,
+    0x06, 0x00, 0xff, 0x09, 0x02, 0xa1, 0x01, 0x85, 0x11, 0x75, 0x08,
+    0x95, 0x13, 0x15, 0x00, 0x26, 0xff, 0x00, 0x09, 0x02, 0x81, 0x00,
+    0x09, 0x02, 0x91, 0x00, 0xc0,
+    0x06, 0x00, 0xff, 0x09, 0x04, 0xa1, 0x01, 0x85, 0x20, 0x75, 0x08,
+    0x95, 0x0e, 0x15, 0x00, 0x26, 0xff, 0x00, 0x09, 0x41, 0x81, 0x00,
+    0x09, 0x41, 0x91, 0x00, 0x85, 0x21, 0x95, 0x1f, 0x15, 0x00, 0x26,
+    0xff, 0x00, 0x09, 0x42, 0x81, 0x00, 0x09, 0x42, 0x91, 0x00, 0xc0,
+])
+
+
+def dj_report(index, report_type, params=b''):
+    data = bytes([REPORT_ID_DJ_SHORT, index, report_type]) + bytes(params)
+    return data.ljust(DJREPORT_SHORT_LENGTH, b'\0')
+
+
+def paired_notification(index, wpid, reports, spfunction=0):
+    return dj_report(index, REPORT_TYPE_NOTIF_DEVICE_PAIRED,
+                     struct.pack('<BHI', spfunction, wpid, reports))
+
+
+class Receiver:
+    """A receiver created through uhid, answering the driver's commands"""
+
+    def __init__(self, phys, rdesc, devices):
+        self.phys = phys
+        self.devices = dict(devices)
+        self.lock = threading.Lock()
+        self.fd = os.open('/dev/uhid', os.O_RDWR)
+
+        rd_data = ctypes.create_string_buffer(rdesc, len(rdesc))
+        pointer = 'Q' if ctypes.sizeof(ctypes.c_void_p) == 8 else 'I'
+        self.write_event(UHID_CREATE, struct.pack(
+            '<128s64s64s%sHHIIII' % pointer,
+            b'Logitech USB Receiver', phys.encode(), b'',
+            ctypes.addressof(rd_data), len(rdesc), BUS_USB,
+            VENDOR_LOGITECH, PRODUCT_UNIFYING, 0, 0))
+
+        self.thread = threading.Thread(target=self.serve)
+        self.thread.daemon = True
+        self.thread.start()
+
+    def write_event(self, event_type, payload):
+        with self.lock:
+            os.write(self.fd, struct.pack('<I', event_type) + payload)
+
+    def input(self, data):
+        self.write_event(UHID_INPUT, struct.pack(
+            '<%dsH' % UHID_DATA_MAX, bytes(data), len(data)))
+
+    def destroy(self):
+        self.write_event(UHID_DESTROY, b'')
+        os.close(self.fd)
+
+    def serve(self):
+        while True:
+            try:
+                event = os.read(self.fd, UHID_EVENT_MAX)
+            except OSError:
+                return
+            if len(event) < 4:
+                continue
+
+            event_type, = struct.unpack_from('<I', event)
+            if event_type == UHID_OUTPUT:
+                size, = struct.unpack_from('<H', event, 4 + UHID_DATA_MAX)
+                self.output(event[4:4 + min(size, UHID_DATA_MAX)])
+            elif event_type == UHID_GET_REPORT:
+                request_id, = struct.unpack_from('<I', event, 4)
+                self.write_event(UHID_GET_REPORT_REPLY, struct.pack(
+                    '<IHH', request_id, errno.EIO, 0))
+            elif event_type == UHID_SET_REPORT:
+                request_id, = struct.unpack_from('<I', event, 4)
+                self.write_event(UHID_SET_REPORT_REPLY, struct.pack(
+                    '<IH', request_id, errno.EIO))
+
+    def output(self, data):
+        if len(data) < 4:
+            return
+
+        if data[0] == REPORT_ID_DJ_SHORT and \
+                data[2] == REPORT_TYPE_CMD_GET_PAIRED_DEVICES:
+            with self.lock:
+                devices = sorted(self.devices.items())
+            if not devices:
+                self.input(paired_notification(
+                    1, 0, 0, SPFUNCTION_DEVICE_LIST_EMPTY))
+            for index, (wpid, reports) in devices:
+                self.input(paired_notification(index, wpid, reports))
+        elif data[0] in (REPORT_ID_HIDPP_SHORT, REPORT_ID_HIDPP_LONG) and \
+                data[2] != HIDPP_ERROR:
+            self.input(bytes([REPORT_ID_HIDPP_SHORT, data[1], HIDPP_ERROR,
+                              data[2], data[3], HIDPP_ERR_INVALID_ADDRESS,
+                              0]))
+
+
+def input_phys():
+    """phys of the input device of each evdev node"""
+    nodes = {}
+    for name in os.listdir('/sys/class/input'):
+        if not name.startswith('event'):
+            continue
+        try:
+            with open('/sys/class/input/%s/device/phys' % name) as f:
+                nodes['/dev/input/' + name] = f.read().strip()
+        except OSError:
+            continue
+    return nodes
+
+
+def input_nodes(prefix):
+    """evdev nodes whose input device phys starts with prefix"""
+    return [node for node, phys in input_phys().items()
+            if phys.startswith(prefix)]
+
+
+def hid_children(prefix):
+    """hid devices whose phys starts with prefix"""
+    children = []
+    for name in os.listdir('/sys/bus/hid/devices'):
+        try:
+            with open('/sys/bus/hid/devices/%s/uevent' % name) as f:
+                uevent = f.read().split('\n')
+        except OSError:
+            continue
+        if any(line.startswith('HID_PHYS=' + prefix) for line in uevent):
+            children.append(name)
+    return children
+
+
+def paired_children(receiver):
+    """hid devices of the devices paired to receiver, leaving out the
+    aggregate ones (phys ending in :0.<class>), kept until its removal"""
+    aggregates = hid_children(receiver.phys + ':0.')
+    return [child for child in hid_children(receiver.phys + ':')
+            if child not in aggregates]
+
+
+def meminfo():
+    info = {}
+    with open('/proc/meminfo') as f:
+        for line in f:
+            fields = line.split()
+            info[fields[0].rstrip(':')] = int(fields[1])
+    return info
+
+
+class EvdevMonitor:
+    """Timestamps of the frames delivered by a set of evdev nodes"""
+
+    def __init__(self, nodes):
+        self.fds = []
+        self.frames = []
+        self.running = True
+        for node in nodes:
+            fd = os.open(node, os.O_RDONLY | os.O_NONBLOCK)
+            fcntl.ioctl(fd, EVIOCSCLOCKID, struct.pack('i', CLOCK_MONOTONIC))
+            self.fds.append(fd)
+        self.thread = threading.Thread(target=self.run)
+        self.thread.daemon = True
+        self.thread.start()
+
+    def run(self):
+        while self.running:
+            ready, _, _ = select.select(self.fds, [], [], 0.1)
+            for fd in ready:
+                try:
+                    buf = os.read(fd, INPUT_EVENT.size * 64)
+                except OSError:
+                    continue
+                for offset in range(0, len(buf), INPUT_EVENT.size):
+                    sec, usec, ev_type, code, value = \
+                        INPUT_EVENT.unpack_from(buf, offset)
+                    if ev_type == EV_SYN and code == SYN_REPORT:
+                        self.frames.append(sec + usec / 1e6)
+
+    def stop(self):
+        self.running = False
+        self.thread.join()
+        for fd in self.fds:
+            os.close(fd)
+        return sorted(self.frames)
+
+
+def read_trace(path):
+    """rdesc and (time, data) input events of a hid-replay trace"""
+    rdesc = None
+    events = []
+    with open(path) as f:
+        for line in f:
+            fields = line.split()
+            if not fields:
+                continue
+            if fields[0] == 'R:':
+                rdesc = bytes(int(b, 16) for b in fields[2:])
+            elif fields[0] == 'E:':
+                events.append((float(fields[1]),
+                               bytes(int(b, 16) for b in fields[3:])))
+    return rdesc, events
+
+
+def parse_device(arg):
+    index, wpid, reports = arg.split(':')
+    return int(index, 16), (int(wpid, 16), int(reports, 16))
+
+
+def synthetic_reports(devices):
+    """Reports always producing a frame: moves back and forth, or a key
+    pressed and released"""
+    for index, (wpid, reports) in sorted(devices.items()):
+        if reports & STD_MOUSE:
+            return [dj_report(index, REPORT_TYPE_MOUSE,
+                              [0, 0, 0x01, 0x00, 0x00, 0, 0]),
+                    dj_report(index, REPORT_TYPE_MOUSE,
+                              [0, 0, 0xff, 0x0f, 0x00, 0, 0])]
+    for index, (wpid, reports) in sorted(devices.items()):
+        if reports & STD_KEYBOARD:
+            return [dj_report(index, REPORT_TYPE_KEYBOARD,
+                              [0, 0x04, 0, 0, 0, 0, 0]),
+                    dj_report(index, REPORT_TYPE_KEYBOARD, [])]
+    return []
+
+
+def wait_for(predicate, timeout):
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        if predicate():
+            return True
+        time.sleep(0.01)
+    return predicate()
+
+
+def percentile(values, p):
+    return values[max(0, int(math.ceil(p / 100.0 * len(values))) - 1)]
+
+
+def replay(args):
+    rdesc = RECEIVER_RDESC
+    devices = {}
+    reports = []
+
+    if args.trace:
+        trace_rdesc, events = read_trace(args.trace)
+        rdesc = trace_rdesc or rdesc
+        start = events[0][0] if events else 0
+        for timestamp, data in events:
+            if len(data) > 2 and data[0] == REPORT_ID_DJ_SHORT and \
+                    data[2] == REPORT_TYPE_NOTIF_DEVICE_PAIRED:
+                wpid, device_reports = struct.unpack_from('<xHI', data, 3)
+                devices[data[1]] = (wpid, device_reports)
+                continue
+            reports.append((timestamp - start, data))
+    if args.rdesc:
+        with open(args.rdesc, 'rb') as f:
+            rdesc = f.read()
+    devices.update(parse_device(d) for d in args.device)
+    if not reports:
+        args.rate = args.rate or 1000
+        reports = [(0, data) for data in synthetic_reports(devices)]
+    if not reports:
+        sys.stderr.write('nothing to replay\n')
+        return 1
+
+    phys = 'dj-replay-%d' % os.getpid()
+    receiver = Receiver(phys, rdesc, devices)
+    try:
+        if not wait_for(lambda: len(input_nodes(phys + ':')) >=
+                        len(devices), args.timeout):
+            sys.stderr.write('the devices did not come up\n')
+            return 1
+        # Let the driver finish with its HID++ queries
+        time.sleep(args.settle)
+
+        monitor = EvdevMonitor(input_nodes(phys + ':'))
+        count = args.count or len(reports)
+        # Trace loops start 1 ms after the end of the previous one
+        period = reports[-1][0] + 0.001
+        writes = []
+        start = time.monotonic()
+        for i in range(count):
+            loop, offset = divmod(i, len(reports))
+            if args.rate:
+                due = i / float(args.rate)
+            else:
+                due = (loop * period + reports[offset][0]) / args.speed
+            delay = start + due - time.monotonic()
+            if delay > 0:
+                time.sleep(delay)
+            writes.append(time.monotonic())
+            receiver.input(reports[offset][1])
+        elapsed = time.monotonic() - start
+
+        time.sleep(args.settle)
+        frames = monitor.stop()
+    finally:
+        receiver.destroy()
+
+    latencies = {}
+    for frame in frames:
+        i = bisect.bisect_right(writes, frame) - 1
+        if i >= 0 and i not in latencies:
+            latencies[i] = (frame - writes[i]) * 1e6
+    latencies = sorted(latencies.values())
+
+    print('reports: %d in %.3f s (%.0f/s)' % (
+        len(writes), elapsed, len(writes) / elapsed if elapsed else 0))
+    print('frames: %d, %d reports matched' % (len(frames), len(latencies)))
+    if latencies:
+        print('latency us: p50 %.0f p99 %.0f p99.9 %.0f max %.0f' % (
+            percentile(latencies, 50), percentile(latencies, 99),
+            percentile(latencies, 99.9), latencies[-1]))
+
+    return 0
+
+
+def stress_event(rng, receiver, paired, pending):
+    """Writes one random event to receiver, returns False if none fits"""
+    index = rng.randint(DJ_DEVICE_INDEX_MIN, DJ_DEVICE_INDEX_MAX)
+    action = rng.random()
+
+    if index not in paired:
+        if action >= 0.1:
+            return False
+        wpid, reports = rng.choice(STRESS_DEVICES)
+        paired[index] = reports
+        pending[(receiver.phys, index)] = time.monotonic()
+        receiver.input(paired_notification(index, wpid, reports))
+    elif action < 0.05:
+        del paired[index]
+        pending.pop((receiver.phys, index), None)
+        receiver.input(dj_report(index, REPORT_TYPE_NOTIF_DEVICE_UNPAIRED))
+    elif action < 0.2:
+        receiver.input(dj_report(index, REPORT_TYPE_NOTIF_CONNECTION_STATUS,
+                                 [rng.choice([0, STATUS_LINKLOSS])]))
+    elif paired[index] & STD_MOUSE:
+        receiver.input(dj_report(index, REPORT_TYPE_MOUSE,
+                                 [0, 0, rng.randint(0, 255),
+                                  rng.randint(0, 255), rng.randint(0, 255),
+                                  0, 0]))
+    else:
+        receiver.input(dj_report(index, REPORT_TYPE_KEYBOARD,
+                                 [0, rng.choice([0, 0x04, 0x05])]))
+
+    return True
+
+
+def stress(args):
+    rng = random.Random(args.seed)
+    pid = os.getpid()
+    receivers = [Receiver('dj-stress-%d-%d' % (pid, n), RECEIVER_RDESC, {})
+                 for n in range(args.receivers)]
+    paired = dict((r.phys, {}) for r in receivers)
+    pending = {}
+    recoveries = []
+    superseded = 0
+    events = 0
+
+    try:
+        time.sleep(args.settle)
+        mem_start = meminfo()
+
+        start = time.monotonic()
+        deadline = start + args.stress
+        next_poll = start
+        next_report = start + args.report_interval
+        while True:
+            now = time.monotonic()
+            if now >= deadline:
+                break
+
+            # Recovery: the input node of a paired device appeared
+            if now >= next_poll:
+                nodes = set(input_phys().values())
+                for key, paired_at in list(pending.items()):
+                    phys = '%s:%d' % key
+                    if phys in nodes or \
+                            any(n.startswith(phys + '/') for n in nodes):
+                        recoveries.append((now - paired_at) * 1e3)
+                        del pending[key]
+                next_poll = now + 0.01
+
+            if now >= next_report:
+                mem = meminfo()
+                print('%6.0f s: %d events (%.0f/s), %d paired, slab %+d kB' %
+                      (now - start, events, events / (now - start),
+                       sum(len(p) for p in paired.values()),
+                       mem['Slab'] - mem_start['Slab']))
+                next_report = now + args.report_interval
+
+            receiver = rng.choice(receivers)
+            before = len(pending)
+            if stress_event(rng, receiver, paired[receiver.phys], pending):
+                events += 1
+                if len(pending) < before:
+                    superseded += 1
+            if args.rate:
+                delay = start + events / args.rate - time.monotonic()
+                if delay > 0:
+                    time.sleep(delay)
+        elapsed = time.monotonic() - start
+
+        # Every device gone, no child may be left
+        for receiver in receivers:
+            for index in list(paired[receiver.phys]):
+                receiver.input(dj_report(index,
+                                         REPORT_TYPE_NOTIF_DEVICE_UNPAIRED))
+        wait_for(lambda: not any(paired_children(r)
+                                 for r in receivers), args.timeout)
+        stuck = sum(len(paired_children(r)) for r in receivers)
+        mem_end = meminfo()
+    finally:
+        for receiver in receivers:
+            receiver.destroy()
+
+    recoveries.sort()
+    print('events: %d in %.1f s (%.0f/s) on %d receivers' % (
+        events, elapsed, events / elapsed, len(receivers)))
+    print('pairings: %d with input, %d unpaired before, %d pending' % (
+        len(recoveries), superseded, len(pending)))
+    if recoveries:
+        print('recovery ms: p50 %.0f p99 %.0f max %.0f' % (
+            percentile(recoveries, 50), percentile(recoveries, 99),
+            recoveries[-1]))
+    print('children left: %d' % stuck)
+    print('memory: slab %+d kB, available %+d kB' % (
+        mem_end['Slab'] - mem_start['Slab'],
+        mem_end.get('MemAvailable', 0) - mem_start.get('MemAvailable', 0)))
+
+    return 1 if stuck else 0
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Replay reports to hid-logitech-dj through an emulated "
+                    "receiver and measure their delivery to evdev")
+    parser.add_argument('--trace', help='hid-replay trace to replay')
+    parser.add_argument('--rdesc',
+                        help='report descriptor of the receiver interface, '
+                             'instead of the trace or built-in one')
+    parser.add_argument('--device', action='append', default=[],
+                        help='paired device, index:wpid:reports in hex, '
+                             'e.g. 2:4013:4 for a mouse')
+    parser.add_argument('--rate', type=float, default=0,
+                        help='reports per second, instead of the timing '
+                             'of the trace')
+    parser.add_argument('--speed', type=float, default=1.0,
+                        help='replay speed factor of the trace')
+    parser.add_argument('--count', type=int, default=0,
+                        help='reports to write, looping over the trace '
+                             '(default: the trace once)')
+    parser.add_argument('--timeout', type=float, default=10.0,
+                        help='seconds to wait for the devices to come up')
+    parser.add_argument('--settle', type=float, default=1.0,
+                        help='seconds to wait before and after replaying')
+    parser.add_argument('--stress', type=float, default=0,
+                        help='seconds of random pairing, connection and '
+                             'input events instead of a replay; --rate then '
+                             'limits the events per second')
+    parser.add_argument('--receivers', type=int, default=1,
+                        help='receivers to emulate with --stress')
+    parser.add_argument('--seed', type=int, help='seed of --stress')
+    parser.add_argument('--report-interval', type=float, default=10.0,
+                        help='seconds between --stress progress lines')
+    args = parser.parse_args()
+
+    if args.rate < 0 or args.speed <= 0:
+        parser.error('--rate and --speed must be positive')
+
+    if args.stress:
+        if args.receivers < 1:
+            parser.error('--receivers must be positive')
+        return stress(args)
+
+    return replay(args)
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,79 @@
+/*
+ *  Tracepoints of the HID driver for Logitech Unifying receivers
+ *
+ *  Copyright (c) 2011 Logitech
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM hid_logitech_dj
+
+#if !defined(_HID_LOGITECH_DJ_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _HID_LOGITECH_DJ_TRACE_H
+
+#include <linux/hid.h>
+#include <linux/tracepoint.h>
+
+/* A phase of logi_dj_probe() completed, elapsed since the probe started */
+TRACE_EVENT(logi_dj_probe_phase,
+	TP_PROTO(struct hid_device *hdev, const char *phase, s64 elapsed_ns),
+	TP_ARGS(hdev, phase, elapsed_ns),
+	TP_STRUCT__entry(
+		__string(receiver, dev_name(&hdev->dev))
+		__string(phase, phase)
+		__field(s64, elapsed_ns)
+	),
+	TP_fast_assign(
+		__assign_str(receiver, dev_name(&hdev->dev));
+		__assign_str(phase, phase);
+		__entry->elapsed_ns = elapsed_ns;
+	),
+	TP_printk("%s %s +%lld ns", __get_str(receiver), __get_str(phase),
+		  __entry->elapsed_ns)
+);
+
+/* A phase of the creation of a paired device completed, elapsed since the
+ * work handling its pairing notification was scheduled */
+TRACE_EVENT(logi_dj_add_phase,
+	TP_PROTO(struct hid_device *hdev, u8 device_index, const char *phase,
+		 s64 elapsed_ns),
+	TP_ARGS(hdev, device_index, phase, elapsed_ns),
+	TP_STRUCT__entry(
+		__string(receiver, dev_name(&hdev->dev))
+		__field(u8, device_index)
+		__string(phase, phase)
+		__field(s64, elapsed_ns)
+	),
+	TP_fast_assign(
+		__assign_str(receiver, dev_name(&hdev->dev));
+		__entry->device_index = device_index;
+		__assign_str(phase, phase);
+		__entry->elapsed_ns = elapsed_ns;
+	),
+	TP_printk("%s:%d %s +%lld ns", __get_str(receiver),
+		  __entry->device_index, __get_str(phase),
+		  __entry->elapsed_ns)
+);
+
+#endif /* _HID_LOGITECH_DJ_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE hid-logitech-dj-trace
+#include <trace/define_trace.h>
@@ -22,14 +22,25 @@
  */
 
 
+#include <linux/debugfs.h>
 #include <linux/device.h>
 #include <linux/hid.h>
+#include <linux/log2.h>
 #include <linux/module.h>
+#include <linux/pm_runtime.h>
+#include <linux/poll.h>
+#include <linux/relay.h>
+#include <linux/seq_file.h>
 #include <linux/usb.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
 #include <asm/unaligned.h>
 #include "hid-ids.h"
 #include "hid-logitech-dj.h"
 
+#define CREATE_TRACE_POINTS
+#include "hid-logitech-dj-trace.h"
+
 /* Keyboard descriptor (1) */
 static const char kbd_descriptor[] = {
 	0x05, 0x01,		/* USAGE_PAGE (generic Desktop)     */
@@ -203,8 +214,25 @@ static const char hidpp_descriptor[] = {
 	0xc0,			/* End Collection                      */
 };
 
-/* Maximum size of all defined hid reports in bytes (including report id) */
-#define MAX_REPORT_SIZE 8
+/* Keyboard usage to key code, the same translation as hid-input does */
+static const unsigned char logi_dj_kbd_keycode[KBD_USAGES_COUNT] = {
+	  0,  0,  0,  0, 30, 48, 46, 32, 18, 33, 34, 35, 23, 36, 37, 38,
+	 50, 49, 24, 25, 16, 19, 31, 20, 22, 47, 17, 45, 21, 44,  2,  3,
+	  4,  5,  6,  7,  8,  9, 10, 11, 28,  1, 14, 15, 57, 12, 13, 26,
+	 27, 43, 43, 39, 40, 41, 51, 52, 53, 58, 59, 60, 61, 62, 63, 64,
+	 65, 66, 67, 68, 87, 88, 99, 70,119,110,102,104,111,107,109,106,
+	105,108,103, 69, 98, 55, 74, 78, 96, 79, 80, 81, 75, 76, 77, 71,
+	 72, 73, 82, 83, 86,127,116,117,183,184,185,186,187,188,189,190,
+	191,192,193,194,134,138,130,132,128,129,131,137,133,135,136,113,
+	115,114,  0,  0,  0,121,  0, 89, 93,124, 92, 94, 95,  0,  0,  0,
+	122,123, 90, 91, 85,  0,  0,  0,  0,  0,  0,  0,111,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 29, 42, 56,125, 97, 54,100,126,164,166,165,163,161,115,114,113,
+	150,158,159,128,136,177,178,176,142,152,173,140
+};
 
 /* Make sure all descriptors are present here */
 #define MAX_RDESC_SIZE				\
@@ -236,332 +264,2387 @@ static const u8 hid_reportid_size_map[NUMBER_OF_HID_REPORTS] = {
 	[8] = 2,		/* Media Center */
 };
 
+/* Reports and name of the aggregate device of each class (aggregate), the
+ * reports_supported bit of a report type being 1 << report type */
+static const u32 logi_dj_aggregate_reports[DJ_AGGREGATE_CLASSES] = {
+	[DJ_AGGREGATE_KEYBOARD] = STD_KEYBOARD | KBD_LEDS,
+	[DJ_AGGREGATE_MOUSE] = STD_MOUSE,
+	[DJ_AGGREGATE_CONSUMER] = MULTIMEDIA,
+	[DJ_AGGREGATE_SYSTEM] = POWER_KEYS,
+	[DJ_AGGREGATE_MEDIA_CENTER] = MEDIA_CENTER,
+};
+
+static const char * const logi_dj_aggregate_names[DJ_AGGREGATE_CLASSES] = {
+	[DJ_AGGREGATE_KEYBOARD] = "Keyboards",
+	[DJ_AGGREGATE_MOUSE] = "Mice",
+	[DJ_AGGREGATE_CONSUMER] = "Consumer Control",
+	[DJ_AGGREGATE_SYSTEM] = "System Control",
+	[DJ_AGGREGATE_MEDIA_CENTER] = "Media Center",
+};
+
+/* Wireless PIDs of the touchpads streaming raw multitouch data over HID++.
+ * They get the WTP group, if wtp_group is set, so a multitouch driver can
+ * bind to them */
+static const u16 logi_dj_wtp_wpids[] = {
+	0x4011,		/* Wireless Touchpad */
+	0x4101,		/* T650 */
+};
+
 
 #define LOGITECH_DJ_INTERFACE_NUMBER 0x02
 
+static int autosuspend_delay_ms = -1;
+module_param(autosuspend_delay_ms, int, S_IRUGO);
+MODULE_PARM_DESC(autosuspend_delay_ms,
+	"Autosuspend the receiver after this many ms without open device "
+	"or pending output (-1: leave the policy to userspace)");
+
+static bool suppress_repeats;
+module_param(suppress_repeats, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(suppress_repeats,
+	"Drop keyboard, consumer, system and media center reports identical "
+	"to the previous one");
+
+static bool kbd_fastpath;
+module_param(kbd_fastpath, bool, S_IRUGO);
+MODULE_PARM_DESC(kbd_fastpath,
+	"Decode the standard keyboard reports in the driver instead of hid-core");
+
+static bool mouse_fastpath;
+module_param(mouse_fastpath, bool, S_IRUGO);
+MODULE_PARM_DESC(mouse_fastpath,
+	"Decode the standard mouse reports in the driver instead of hid-core");
+
+static int hidpp_routing;
+module_param(hidpp_routing, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(hidpp_routing,
+	"HID++ reports routing (0: to both the receiver and the device nodes, "
+	"1: to the device node if it issued the request or subscribed, "
+	"else to the receiver node only)");
+
+static unsigned int hidpp_ring_frames;
+module_param(hidpp_ring_frames, uint, S_IRUGO);
+MODULE_PARM_DESC(hidpp_ring_frames,
+	"Size in frames of the mmap()able HID++ ring exposed in debugfs, "
+	"rounded up to a power of two, at most 1048576 (0: no ring)");
+
+static bool wtp_group;
+module_param(wtp_group, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(wtp_group,
+	"Leave the Logitech touchpads to a HID++ multitouch driver (e.g. "
+	"hid-logitech-wtp) instead of reporting them as mice, needs such a "
+	"driver to be loaded");
+
+static bool hires_scroll;
+module_param(hires_scroll, bool, S_IRUGO);
+MODULE_PARM_DESC(hires_scroll,
+	"Switch capable mice to high resolution scrolling and report "
+	"REL_WHEEL_HI_RES (implies mouse_fastpath)");
+
+static char *poll_intervals;
+module_param(poll_intervals, charp, S_IRUGO);
+MODULE_PARM_DESC(poll_intervals,
+	"Polling intervals in ms of given receivers, keyed by USB device, "
+	"e.g. \"1-2.3=1,3-4=2\"");
+
+static unsigned int capture_kb;
+module_param(capture_kb, uint, S_IRUGO);
+MODULE_PARM_DESC(capture_kb,
+	"Size in kB per cpu of the traffic capture buffers in debugfs "
+	"(0: no capture)");
+
+static bool aggregate;
+module_param(aggregate, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(aggregate,
+	"Report the keyboards, mice and consumer keys paired to a receiver "
+	"through one device per report class, read at probe");
+
+static struct dentry *logi_dj_debugfs_root;
+/* Serializes the opening of debugfs files with their revocation */
+static DEFINE_MUTEX(logi_dj_debugfs_mutex);
+
 static struct hid_ll_driver logi_dj_ll_driver;
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 15, 0)
 static int logi_dj_output_hidraw_report(struct hid_device *hid, u8 * buf,
 					size_t count,
 					unsigned char report_type);
+#endif
 static int logi_dj_recv_query_paired_devices(struct dj_receiver_dev *djrcv_dev);
+static int logi_dj_recv_queue_output(struct dj_receiver_dev *djrcv_dev,
+				     u8 *data, size_t size);
+static void logi_dj_recv_fetch_pairing_info(struct dj_receiver_dev *djrcv_dev);
+static void logi_dj_recv_forward_null_report(struct dj_receiver_dev *djrcv_dev,
+					     struct dj_report *dj_report);
+static void logi_dj_dev_enable_hires(struct dj_device *dj_dev);
+static int logi_dj_dev_hidpp20_call(struct dj_device *dj_dev, u8 index,
+				    u8 function, const u8 *params, int count,
+				    u8 *response);
+static int logi_dj_dev_hidpp20_feature(struct dj_device *dj_dev, u16 feature);
+
+static const char * const dj_link_state_names[] = {
+	[DJ_LINK_UNKNOWN] = "unknown",
+	[DJ_LINK_CONNECTED] = "connected",
+	[DJ_LINK_DISCONNECTED] = "disconnected",
+};
 
-static void logi_dj_recv_destroy_djhid_device(struct dj_receiver_dev *djrcv_dev,
-						struct dj_report *dj_report)
+static const char * const dj_probe_phase_names[] = {
+	[DJ_PROBE_START] = "start",
+	[DJ_PROBE_PARSED] = "hid_parse",
+	[DJ_PROBE_HW_STARTED] = "hid_hw_start",
+	[DJ_PROBE_DJ_MODE] = "switch_to_dj_mode",
+	[DJ_PROBE_HW_OPENED] = "hid_hw_open",
+	[DJ_PROBE_QUERIED] = "query_paired_devices",
+};
+
+static const char * const dj_add_phase_names[] = {
+	[DJ_ADD_QUEUED] = "queued",
+	[DJ_ADD_STARTED] = "work_started",
+	[DJ_ADD_PAIRING_INFO] = "pairing_info",
+	[DJ_ADD_HID_ADDED] = "hid_add_device",
+	[DJ_ADD_DONE] = "done",
+};
+
+static ssize_t logi_dj_link_state_show(struct device *dev,
+				       struct device_attribute *attr, char *buf)
 {
-	/* Called in delayed work context */
-	struct dj_device *dj_dev;
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct dj_device *dj_dev = hdev->driver_data;
 	unsigned long flags;
+	u8 link_state;
 
-	spin_lock_irqsave(&djrcv_dev->lock, flags);
-	dj_dev = djrcv_dev->paired_dj_devices[dj_report->device_index];
-	djrcv_dev->paired_dj_devices[dj_report->device_index] = NULL;
-	spin_unlock_irqrestore(&djrcv_dev->lock, flags);
+	spin_lock_irqsave(&dj_dev->dj_receiver_dev->lock, flags);
+	link_state = dj_dev->link_state;
+	spin_unlock_irqrestore(&dj_dev->dj_receiver_dev->lock, flags);
 
-	if (dj_dev != NULL) {
-		hid_destroy_device(dj_dev->hdev);
-		kfree(dj_dev);
-	} else {
-		dev_err(&djrcv_dev->hdev->dev, "%s: can't destroy a NULL device\n",
-			__func__);
-	}
+	return scnprintf(buf, PAGE_SIZE, "%s\n",
+			 dj_link_state_names[link_state]);
 }
 
-static void logi_dj_recv_add_djhid_device(struct dj_receiver_dev *djrcv_dev,
-					  struct dj_report *dj_report)
+static DEVICE_ATTR(link_state, S_IRUGO, logi_dj_link_state_show, NULL);
+
+static ssize_t logi_dj_link_state_timestamp_show(struct device *dev,
+						 struct device_attribute *attr,
+						 char *buf)
 {
-	/* Called in delayed work context */
-	struct hid_device *djrcv_hdev = djrcv_dev->hdev;
-	struct usb_interface *intf = to_usb_interface(djrcv_hdev->dev.parent);
-	struct usb_device *usbdev = interface_to_usbdev(intf);
-	struct hid_device *dj_hiddev;
-	struct dj_device *dj_dev;
+	/* CLOCK_MONOTONIC time of the last link state change, in ns */
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct dj_device *dj_dev = hdev->driver_data;
+	unsigned long flags;
+	ktime_t link_changed;
 
-	/* Device index goes from 1 to 6, we need 3 bytes to store the
-	 * semicolon, the index, and a null terminator
-	 */
-	unsigned char tmpstr[3];
+	spin_lock_irqsave(&dj_dev->dj_receiver_dev->lock, flags);
+	link_changed = dj_dev->link_changed;
+	spin_unlock_irqrestore(&dj_dev->dj_receiver_dev->lock, flags);
 
-	if (dj_report->report_params[DEVICE_PAIRED_PARAM_SPFUNCTION] &
-	    SPFUNCTION_DEVICE_LIST_EMPTY) {
-		dbg_hid("%s: device list is empty\n", __func__);
-		djrcv_dev->querying_devices = false;
-		return;
-	}
+	return scnprintf(buf, PAGE_SIZE, "%lld\n", ktime_to_ns(link_changed));
+}
 
-	if ((dj_report->device_index < DJ_DEVICE_INDEX_MIN) ||
-	    (dj_report->device_index > DJ_DEVICE_INDEX_MAX)) {
-		dev_err(&djrcv_hdev->dev, "%s: invalid device index:%d\n",
-			__func__, dj_report->device_index);
-		return;
-	}
+static DEVICE_ATTR(link_state_timestamp, S_IRUGO,
+		   logi_dj_link_state_timestamp_show, NULL);
 
-	if (djrcv_dev->paired_dj_devices[dj_report->device_index]) {
-		/* The device is already known. No need to reallocate it. */
-		dbg_hid("%s: device is already known\n", __func__);
-		return;
-	}
+static ssize_t logi_dj_suppressed_reports_show(struct device *dev,
+					       struct device_attribute *attr,
+					       char *buf)
+{
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct dj_device *dj_dev = hdev->driver_data;
 
-	dj_hiddev = hid_allocate_device();
-	if (IS_ERR(dj_hiddev)) {
-		dev_err(&djrcv_hdev->dev, "%s: hid_allocate_device failed\n",
-			__func__);
-		return;
-	}
+	return scnprintf(buf, PAGE_SIZE, "%lu\n", dj_dev->suppressed_reports);
+}
 
-	dj_hiddev->ll_driver = &logi_dj_ll_driver;
-	dj_hiddev->hid_output_raw_report = logi_dj_output_hidraw_report;
+static DEVICE_ATTR(suppressed_reports, S_IRUGO,
+		   logi_dj_suppressed_reports_show, NULL);
 
-	dj_hiddev->dev.parent = &djrcv_hdev->dev;
-	dj_hiddev->bus = BUS_USB;
-	dj_hiddev->vendor = le16_to_cpu(usbdev->descriptor.idVendor);
-	dj_hiddev->product =
-	    (dj_report->report_params[DEVICE_PAIRED_PARAM_EQUAD_ID_MSB] << 8) |
-	     dj_report->report_params[DEVICE_PAIRED_PARAM_EQUAD_ID_LSB];
-	snprintf(dj_hiddev->name, sizeof(dj_hiddev->name),
-		"Logitech Unifying Device. Wireless PID:%04x",
-		dj_hiddev->product);
+static ssize_t logi_dj_delivery_latency_show(struct device *dev,
+					     struct device_attribute *attr,
+					     char *buf)
+{
+	/* "last average max" time in ns between the arrival of an input
+	 * report in raw_event and its delivery to the input layer */
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct dj_device *dj_dev = hdev->driver_data;
+	unsigned long flags;
+	s64 last, sum, max;
+	u64 count;
 
-	dj_hiddev->group = HID_GROUP_LOGITECH_DJ_DEVICE_GENERIC;
-	dj_hiddev->product = le16_to_cpu(usbdev->descriptor.idProduct);
+	spin_lock_irqsave(&dj_dev->dj_receiver_dev->lock, flags);
+	last = dj_dev->delivery_latency_last;
+	max = dj_dev->delivery_latency_max;
+	sum = dj_dev->delivery_latency_sum;
+	count = dj_dev->delivery_count;
+	spin_unlock_irqrestore(&dj_dev->dj_receiver_dev->lock, flags);
 
-	usb_make_path(usbdev, dj_hiddev->phys, sizeof(dj_hiddev->phys));
-	snprintf(tmpstr, sizeof(tmpstr), ":%d", dj_report->device_index);
-	strlcat(dj_hiddev->phys, tmpstr, sizeof(dj_hiddev->phys));
+	if (count)
+		sum = div64_u64(sum, count);
 
-	dj_dev = kzalloc(sizeof(struct dj_device), GFP_KERNEL);
+	return scnprintf(buf, PAGE_SIZE, "%lld %lld %lld\n", last, sum, max);
+}
 
-	if (!dj_dev) {
-		dev_err(&djrcv_hdev->dev, "%s: failed allocating dj_device\n",
-			__func__);
-		goto dj_device_allocate_fail;
-	}
+static DEVICE_ATTR(delivery_latency_ns, S_IRUGO,
+		   logi_dj_delivery_latency_show, NULL);
 
-	dj_dev->reports_supported = get_unaligned_le32(
-		dj_report->report_params + DEVICE_PAIRED_RF_REPORT_TYPE);
-	dj_dev->hdev = dj_hiddev;
-	dj_dev->dj_receiver_dev = djrcv_dev;
-	dj_dev->device_index = dj_report->device_index;
-	dj_hiddev->driver_data = dj_dev;
+static struct dj_report_filter *logi_dj_dev_get_filter(struct dj_device *dj_dev)
+{
+	/* Called in process context */
+	struct dj_report_filter *filter;
+	unsigned long flags;
+	int i;
 
-	djrcv_dev->paired_dj_devices[dj_report->device_index] = dj_dev;
+	if (dj_dev->filter)
+		return dj_dev->filter;
 
-	if (hid_add_device(dj_hiddev)) {
-		dev_err(&djrcv_hdev->dev, "%s: failed adding dj_device\n",
-			__func__);
-		goto hid_add_device_fail;
+	filter = kzalloc(sizeof(struct dj_report_filter), GFP_KERNEL);
+	if (!filter)
+		return NULL;
+
+	for (i = 0; i < KBD_USAGES_COUNT; i++)
+		filter->key_remap[i] = i;
+	for (i = 0; i < MOUSE_BUTTONS_COUNT; i++)
+		filter->button_remap[i] = i + 1;
+
+	spin_lock_irqsave(&dj_dev->dj_receiver_dev->lock, flags);
+	if (!dj_dev->filter) {
+		dj_dev->filter = filter;
+		filter = NULL;
 	}
+	spin_unlock_irqrestore(&dj_dev->dj_receiver_dev->lock, flags);
 
-	return;
+	kfree(filter);
 
-hid_add_device_fail:
-	djrcv_dev->paired_dj_devices[dj_report->device_index] = NULL;
-	kfree(dj_dev);
-dj_device_allocate_fail:
-	hid_destroy_device(dj_hiddev);
+	return dj_dev->filter;
 }
 
-static void delayedwork_callback(struct work_struct *work)
+static ssize_t logi_dj_drop_report_types_show(struct device *dev,
+					      struct device_attribute *attr,
+					      char *buf)
 {
-	struct dj_receiver_dev *djrcv_dev =
-		container_of(work, struct dj_receiver_dev, work);
-
-	struct dj_report dj_report;
-	unsigned long flags;
-	int count;
-	int retval;
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct dj_device *dj_dev = hdev->driver_data;
 
-	dbg_hid("%s\n", __func__);
-
-	spin_lock_irqsave(&djrcv_dev->lock, flags);
+	return scnprintf(buf, PAGE_SIZE, "%08x\n",
+			 dj_dev->filter ? dj_dev->filter->drop_types : 0);
+}
 
-	count = kfifo_out(&djrcv_dev->notif_fifo, &dj_report,
-				sizeof(struct dj_report));
+static ssize_t logi_dj_drop_report_types_store(struct device *dev,
+					       struct device_attribute *attr,
+					       const char *buf, size_t count)
+{
+	/* Bitfield of RF report types to drop, bit n being report type n */
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct dj_device *dj_dev = hdev->driver_data;
+	struct dj_report_filter *filter;
+	unsigned int drop_types;
 
-	if (count != sizeof(struct dj_report)) {
-		dev_err(&djrcv_dev->hdev->dev, "%s: workitem triggered without "
-			"notifications available\n", __func__);
-		spin_unlock_irqrestore(&djrcv_dev->lock, flags);
-		return;
-	}
+	if (kstrtouint(buf, 16, &drop_types))
+		return -EINVAL;
 
-	if (!kfifo_is_empty(&djrcv_dev->notif_fifo)) {
-		if (schedule_work(&djrcv_dev->work) == 0) {
-			dbg_hid("%s: did not schedule the work item, was "
-				"already queued\n", __func__);
-		}
-	}
+	filter = logi_dj_dev_get_filter(dj_dev);
+	if (!filter)
+		return -ENOMEM;
 
-	spin_unlock_irqrestore(&djrcv_dev->lock, flags);
+	filter->drop_types = drop_types;
 
-	switch (dj_report.report_type) {
-	case REPORT_TYPE_NOTIF_DEVICE_PAIRED:
-		logi_dj_recv_add_djhid_device(djrcv_dev, &dj_report);
-		break;
-	case REPORT_TYPE_NOTIF_DEVICE_UNPAIRED:
-		logi_dj_recv_destroy_djhid_device(djrcv_dev, &dj_report);
-		break;
-	default:
-	/* A normal report (i. e. not belonging to a pair/unpair notification)
-	 * arriving here, means that the report arrived but we did not have a
-	 * paired dj_device associated to the report's device_index, this
-	 * means that the original "device paired" notification corresponding
-	 * to this dj_device never arrived to this driver. The reason is that
-	 * hid-core discards all packets coming from a device while probe() is
-	 * executing. */
-	if (!djrcv_dev->paired_dj_devices[dj_report.device_index]) {
-		/* ok, we don't know the device, just re-ask the
-		 * receiver for the list of connected devices. */
-		retval = logi_dj_recv_query_paired_devices(djrcv_dev);
-		if (!retval) {
-			/* everything went fine, so just leave */
-			break;
-		}
-		dev_err(&djrcv_dev->hdev->dev,
-			"%s:logi_dj_recv_query_paired_devices "
-			"error:%d\n", __func__, retval);
-		}
-		dbg_hid("%s: unexpected report type\n", __func__);
-	}
+	return count;
 }
 
-static void logi_dj_recv_queue_notification(struct dj_receiver_dev *djrcv_dev,
-					   struct dj_report *dj_report)
+static DEVICE_ATTR(drop_report_types, S_IRUGO | S_IWUSR,
+		   logi_dj_drop_report_types_show,
+		   logi_dj_drop_report_types_store);
+
+static ssize_t logi_dj_key_remap_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
 {
-	/* We are called from atomic context (tasklet && djrcv->lock held) */
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct dj_device *dj_dev = hdev->driver_data;
+	struct dj_report_filter *filter = dj_dev->filter;
+	ssize_t len = 0;
+	int i;
 
-	kfifo_in(&djrcv_dev->notif_fifo, dj_report, sizeof(struct dj_report));
+	if (!filter)
+		return 0;
 
-	if (schedule_work(&djrcv_dev->work) == 0) {
-		dbg_hid("%s: did not schedule the work item, was already "
-			"queued\n", __func__);
+	for (i = 0; i < KBD_USAGES_COUNT; i++) {
+		if (filter->key_remap[i] != i)
+			len += scnprintf(buf + len, PAGE_SIZE - len,
+					 "%02x %02x\n", i,
+					 filter->key_remap[i]);
 	}
+
+	return len;
 }
 
-static void logi_dj_recv_forward_null_report(struct dj_receiver_dev *djrcv_dev,
-					     struct dj_report *dj_report)
+static ssize_t logi_dj_key_remap_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count)
 {
-	/* We are called from atomic context (tasklet && djrcv->lock held) */
-	unsigned int i;
-	u8 reportbuffer[MAX_REPORT_SIZE];
-	struct dj_device *djdev;
+	/* "<usage> <new usage>" in hex, a new usage of 0 drops the key */
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct dj_device *dj_dev = hdev->driver_data;
+	struct dj_report_filter *filter;
+	unsigned int from, to;
+
+	if (sscanf(buf, "%x %x", &from, &to) != 2 ||
+	    from >= KBD_USAGES_COUNT || to >= KBD_USAGES_COUNT)
+		return -EINVAL;
+
+	filter = logi_dj_dev_get_filter(dj_dev);
+	if (!filter)
+		return -ENOMEM;
 
-	djdev = djrcv_dev->paired_dj_devices[dj_report->device_index];
+	filter->key_remap[from] = to;
 
-	if (!djdev) {
-		dbg_hid("djrcv_dev->paired_dj_devices[dj_report->device_index]"
-			" is NULL, index %d\n", dj_report->device_index);
-		kfifo_in(&djrcv_dev->notif_fifo, dj_report, sizeof(struct dj_report));
+	return count;
+}
 
-		if (schedule_work(&djrcv_dev->work) == 0) {
-			dbg_hid("%s: did not schedule the work item, was already "
-			"queued\n", __func__);
-		}
-		return;
-	}
+static DEVICE_ATTR(key_remap, S_IRUGO | S_IWUSR, logi_dj_key_remap_show,
+		   logi_dj_key_remap_store);
 
-	memset(reportbuffer, 0, sizeof(reportbuffer));
+static ssize_t logi_dj_button_remap_show(struct device *dev,
+					 struct device_attribute *attr,
+					 char *buf)
+{
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct dj_device *dj_dev = hdev->driver_data;
+	struct dj_report_filter *filter = dj_dev->filter;
+	ssize_t len = 0;
+	int i;
 
-	for (i = 0; i < NUMBER_OF_HID_REPORTS; i++) {
-		if (djdev->reports_supported & (1 << i)) {
-			reportbuffer[0] = i;
-			if (hid_input_report(djdev->hdev,
-					     HID_INPUT_REPORT,
-					     reportbuffer,
-					     hid_reportid_size_map[i], 1)) {
-				dbg_hid("hid_input_report error sending null "
-					"report\n");
-			}
-		}
+	if (!filter)
+		return 0;
+
+	for (i = 0; i < MOUSE_BUTTONS_COUNT; i++) {
+		if (filter->button_remap[i] != i + 1)
+			len += scnprintf(buf + len, PAGE_SIZE - len,
+					 "%d %d\n", i + 1,
+					 filter->button_remap[i]);
 	}
+
+	return len;
 }
 
-static void logi_dj_recv_forward_report(struct dj_receiver_dev *djrcv_dev,
-					struct dj_report *dj_report)
+static ssize_t logi_dj_button_remap_store(struct device *dev,
+					  struct device_attribute *attr,
+					  const char *buf, size_t count)
 {
-	/* We are called from atomic context (tasklet && djrcv->lock held) */
-	struct dj_device *dj_device;
+	/* "<button> <new button>", 1 based, a new button of 0 drops it */
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct dj_device *dj_dev = hdev->driver_data;
+	struct dj_report_filter *filter;
+	unsigned int from, to;
+
+	if (sscanf(buf, "%u %u", &from, &to) != 2 ||
+	    from < 1 || from > MOUSE_BUTTONS_COUNT ||
+	    to > MOUSE_BUTTONS_COUNT)
+		return -EINVAL;
+
+	filter = logi_dj_dev_get_filter(dj_dev);
+	if (!filter)
+		return -ENOMEM;
 
-	dj_device = djrcv_dev->paired_dj_devices[dj_report->device_index];
+	filter->button_remap[from - 1] = to;
 
-	if (dj_device == NULL) {
-		dbg_hid("djrcv_dev->paired_dj_devices[dj_report->device_index]"
-			" is NULL, index %d\n", dj_report->device_index);
-		kfifo_in(&djrcv_dev->notif_fifo, dj_report, sizeof(struct dj_report));
+	return count;
+}
 
-		if (schedule_work(&djrcv_dev->work) == 0) {
-			dbg_hid("%s: did not schedule the work item, was already "
-			"queued\n", __func__);
-		}
-		return;
-	}
+static DEVICE_ATTR(button_remap, S_IRUGO | S_IWUSR, logi_dj_button_remap_show,
+		   logi_dj_button_remap_store);
 
-	if ((dj_report->report_type > ARRAY_SIZE(hid_reportid_size_map) - 1) ||
-	    (hid_reportid_size_map[dj_report->report_type] == 0)) {
-		dbg_hid("invalid report type:%x\n", dj_report->report_type);
-		return;
-	}
+static ssize_t logi_dj_hidpp_subscribe_show(struct device *dev,
+					    struct device_attribute *attr,
+					    char *buf)
+{
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct dj_device *dj_dev = hdev->driver_data;
 
-	if (hid_input_report(dj_device->hdev,
-			HID_INPUT_REPORT, &dj_report->report_type,
-			hid_reportid_size_map[dj_report->report_type], 1)) {
-		dbg_hid("hid_input_report error\n");
-	}
+	return scnprintf(buf, PAGE_SIZE, "%d\n", dj_dev->hidpp_subscribed);
 }
 
-static void logi_dj_recv_forward_hidpp(struct dj_receiver_dev *djrcv_dev,
-			u8 *data, int size)
+static ssize_t logi_dj_hidpp_subscribe_store(struct device *dev,
+					     struct device_attribute *attr,
+					     const char *buf, size_t count)
 {
-	/* We are called from atomic context (tasklet && djrcv->lock held) */
-
-	struct dj_device *dj_dev = NULL;
-	u8 device_index = data[1];
-
-	if ((device_index < DJ_DEVICE_INDEX_MIN) ||
-	    (device_index > DJ_DEVICE_INDEX_MAX))
-		return;
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct dj_device *dj_dev = hdev->driver_data;
+	unsigned long flags;
+	bool subscribed;
 
-	dj_dev = djrcv_dev->paired_dj_devices[device_index];
+	if (strtobool(buf, &subscribed))
+		return -EINVAL;
 
-	if (!dj_dev)
-		return;
+	spin_lock_irqsave(&dj_dev->dj_receiver_dev->lock, flags);
+	dj_dev->hidpp_subscribed = subscribed;
+	spin_unlock_irqrestore(&dj_dev->dj_receiver_dev->lock, flags);
 
-	hid_input_report(dj_dev->hdev, HID_INPUT_REPORT, data, size, 1);
+	return count;
 }
 
-static int logi_dj_recv_send_report(struct dj_receiver_dev *djrcv_dev,
-				    struct dj_report *dj_report)
-{
-	struct hid_device *hdev = djrcv_dev->hdev;
-	struct hid_report *report;
-	struct hid_report_enum *output_report_enum;
-	u8 *data = (u8 *)(&dj_report->device_index);
-	unsigned int i;
+static DEVICE_ATTR(hidpp_subscribe, S_IRUGO | S_IWUSR,
+		   logi_dj_hidpp_subscribe_show, logi_dj_hidpp_subscribe_store);
 
-	output_report_enum = &hdev->report_enum[HID_OUTPUT_REPORT];
-	report = output_report_enum->report_id_hash[REPORT_ID_DJ_SHORT];
+static int logi_dj_dev_report_rates(struct dj_device *dj_dev, int *index,
+				    u8 *rates)
+{
+	/* Called in process context. Fills the HID++ index of the report rate
+	 * feature and the bitfield of the supported intervals, queried once */
+	u8 response[HIDPP_REPORT_LONG_LENGTH];
+	int retval;
 
-	if (!report) {
-		dev_err(&hdev->dev, "%s: unable to find dj report\n", __func__);
-		return -ENODEV;
+	if (dj_dev->report_rates) {
+		*index = dj_dev->report_rate_index;
+		*rates = dj_dev->report_rates;
+		return 0;
 	}
 
-	for (i = 0; i < DJREPORT_SHORT_LENGTH - 1; i++)
-		report->field[0]->value[i] = data[i];
+	*index = logi_dj_dev_hidpp20_feature(dj_dev,
+					     HIDPP20_FEATURE_REPORT_RATE);
+	if (*index < 0)
+		return *index;
+	if (!*index)
+		return -EOPNOTSUPP;
 
-	hid_hw_request(hdev, report, HID_REQ_SET_REPORT);
+	retval = logi_dj_dev_hidpp20_call(dj_dev, *index,
+					  HIDPP20_REPORT_RATE_GET_LIST,
+					  NULL, 0, response);
+	if (retval)
+		return retval;
+
+	*rates = response[HIDPP20_PARAMS];
+	if (!*rates)
+		return -EOPNOTSUPP;
+
+	dj_dev->report_rate_index = *index;
+	dj_dev->report_rates = *rates;
 
 	return 0;
 }
 
-static int logi_dj_recv_query_paired_devices(struct dj_receiver_dev *djrcv_dev)
+static int logi_dj_dev_set_report_rate(struct dj_device *dj_dev, u8 rate_ms)
 {
-	struct dj_report *dj_report;
-	int retval;
+	/* Called in process context */
+	int index, retval;
+	u8 rates;
 
-	/* no need to protect djrcv_dev->querying_devices */
-	if (djrcv_dev->querying_devices)
-		return 0;
+	retval = logi_dj_dev_report_rates(dj_dev, &index, &rates);
+	if (retval)
+		return retval;
+
+	if (!rate_ms || rate_ms > 8 || !(rates & (1 << (rate_ms - 1))))
+		return -EINVAL;
+
+	return logi_dj_dev_hidpp20_call(dj_dev, index, HIDPP20_REPORT_RATE_SET,
+					&rate_ms, 1, NULL);
+}
+
+static int logi_dj_dev_closest_report_rate(u8 rates, unsigned int rate)
+{
+	/* Supported interval in ms closest to the rate in Hz */
+	unsigned int hz, diff, best_diff = UINT_MAX;
+	int i, best = 0;
+
+	for (i = 0; i < 8; i++) {
+		if (!(rates & (1 << i)))
+			continue;
+
+		hz = 1000 / (i + 1);
+		diff = hz > rate ? hz - rate : rate - hz;
+		if (diff < best_diff) {
+			best_diff = diff;
+			best = i + 1;
+		}
+	}
+
+	return best;
+}
+
+static ssize_t logi_dj_report_rate_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	/* Current report rate, in Hz */
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct dj_device *dj_dev = hdev->driver_data;
+	u8 response[HIDPP_REPORT_LONG_LENGTH];
+	int index, retval;
+
+	index = logi_dj_dev_hidpp20_feature(dj_dev,
+					    HIDPP20_FEATURE_REPORT_RATE);
+	if (index < 0)
+		return index;
+	if (!index)
+		return -EOPNOTSUPP;
+
+	retval = logi_dj_dev_hidpp20_call(dj_dev, index,
+					  HIDPP20_REPORT_RATE_GET,
+					  NULL, 0, response);
+	if (retval)
+		return retval;
+	if (!response[HIDPP20_PARAMS])
+		return -EIO;
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n",
+			 1000 / response[HIDPP20_PARAMS]);
+}
+
+static ssize_t logi_dj_report_rate_store(struct device *dev,
+					 struct device_attribute *attr,
+					 const char *buf, size_t count)
+{
+	/* Report rate in Hz, rounded to the closest of report_rates_available */
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct dj_device *dj_dev = hdev->driver_data;
+	unsigned int rate;
+	int index, retval, rate_ms;
+	u8 rates;
+
+	if (kstrtouint(buf, 10, &rate) || !rate)
+		return -EINVAL;
+
+	retval = logi_dj_dev_report_rates(dj_dev, &index, &rates);
+	if (retval)
+		return retval;
+
+	rate_ms = logi_dj_dev_closest_report_rate(rates, rate);
+	retval = logi_dj_dev_set_report_rate(dj_dev, rate_ms);
+	if (retval)
+		return retval;
+
+	dj_dev->report_rate_ms = rate_ms;
+
+	return count;
+}
+
+static DEVICE_ATTR(report_rate, S_IRUGO | S_IWUSR, logi_dj_report_rate_show,
+		   logi_dj_report_rate_store);
+
+static ssize_t logi_dj_report_rates_available_show(struct device *dev,
+						   struct device_attribute *attr,
+						   char *buf)
+{
+	/* Supported report rates, in Hz */
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct dj_device *dj_dev = hdev->driver_data;
+	ssize_t len = 0;
+	int index, retval, i;
+	u8 rates;
+
+	retval = logi_dj_dev_report_rates(dj_dev, &index, &rates);
+	if (retval)
+		return retval;
+
+	for (i = 0; i < 8; i++) {
+		if (rates & (1 << i))
+			len += scnprintf(buf + len, PAGE_SIZE - len, "%s%d",
+					 len ? " " : "", 1000 / (i + 1));
+	}
+	len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+
+	return len;
+}
+
+static DEVICE_ATTR(report_rates_available, S_IRUGO,
+		   logi_dj_report_rates_available_show, NULL);
+
+static struct attribute *logi_dj_device_attrs[] = {
+	&dev_attr_link_state.attr,
+	&dev_attr_link_state_timestamp.attr,
+	&dev_attr_suppressed_reports.attr,
+	&dev_attr_delivery_latency_ns.attr,
+	&dev_attr_drop_report_types.attr,
+	&dev_attr_key_remap.attr,
+	&dev_attr_button_remap.attr,
+	&dev_attr_hidpp_subscribe.attr,
+	&dev_attr_report_rate.attr,
+	&dev_attr_report_rates_available.attr,
+	NULL
+};
+
+static umode_t logi_dj_device_attr_is_visible(struct kobject *kobj,
+					      struct attribute *attr, int n)
+{
+	struct device *dev = container_of(kobj, struct device, kobj);
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct dj_device *dj_dev = hdev->driver_data;
+
+	/* The report rate feature belongs to the mice */
+	if ((attr == &dev_attr_report_rate.attr ||
+	     attr == &dev_attr_report_rates_available.attr) &&
+	    !(dj_dev->reports_supported & STD_MOUSE))
+		return 0;
+
+	return attr->mode;
+}
+
+static const struct attribute_group logi_dj_device_attr_group = {
+	.attrs = logi_dj_device_attrs,
+	.is_visible = logi_dj_device_attr_is_visible,
+};
+
+static int logi_dj_input_open(struct input_dev *dev)
+{
+	struct dj_device *dj_dev = input_get_drvdata(dev);
+
+	/* Keep the receiver awake while the input is in use, as
+	 * logi_dj_ll_open() does for the inputs of hid-core */
+	return hid_hw_power(dj_dev->dj_receiver_dev->hdev, PM_HINT_FULLON);
+}
+
+static void logi_dj_input_close(struct input_dev *dev)
+{
+	struct dj_device *dj_dev = input_get_drvdata(dev);
+
+	hid_hw_power(dj_dev->dj_receiver_dev->hdev, PM_HINT_NORMAL);
+}
+
+static bool logi_dj_dev_is_aggregate(struct dj_device *dj_dev)
+{
+	/* Paired devices have indexes from DJ_DEVICE_INDEX_MIN */
+	return dj_dev->device_index == 0;
+}
+
+static int logi_dj_dev_set_leds(struct dj_device *dj_dev, u8 leds)
+{
+	/* May be called from atomic context. The leds of the aggregate
+	 * device are those of all the aggregated keyboards */
+	struct dj_receiver_dev *djrcv_dev = dj_dev->dj_receiver_dev;
+	u8 data[DJREPORT_SHORT_LENGTH] = { REPORT_ID_DJ_SHORT };
+	unsigned long slots;
+	int i, retval = 0;
+
+	data[2] = REPORT_TYPE_LEDS;
+	data[3] = leds;
+
+	if (!logi_dj_dev_is_aggregate(dj_dev)) {
+		data[1] = dj_dev->device_index;
+		return logi_dj_recv_queue_output(djrcv_dev, data, sizeof(data));
+	}
+
+	slots = ACCESS_ONCE(djrcv_dev->aggregate_kbd_slots);
+	for_each_set_bit(i, &slots, DJ_DEVICE_INDEX_MAX + 1) {
+		data[1] = i;
+		if (logi_dj_recv_queue_output(djrcv_dev, data, sizeof(data)))
+			retval = -EBUSY;
+	}
+
+	return retval;
+}
+
+static int logi_dj_kbd_event(struct input_dev *dev, unsigned int type,
+			     unsigned int code, int value)
+{
+	/* Sent by the input layer to handle leds, dev->led is up to date */
+	struct dj_device *dj_dev = input_get_drvdata(dev);
+
+	if (type != EV_LED)
+		return -1;
+
+	return logi_dj_dev_set_leds(dj_dev, dev->led[0] & KBD_LEDS_MASK) ?
+		-1 : 0;
+}
+
+static struct input_dev *logi_dj_kbd_alloc(struct dj_device *dj_dev)
+{
+	struct hid_device *hdev = dj_dev->hdev;
+	struct input_dev *input;
+	int i;
+
+	input = input_allocate_device();
+	if (!input)
+		return NULL;
+
+	input->name = hdev->name;
+	input->phys = hdev->phys;
+	input->uniq = hdev->uniq;
+	input->id.bustype = hdev->bus;
+	input->id.vendor = hdev->vendor;
+	input->id.product = hdev->product;
+	input->dev.parent = &hdev->dev;
+	input->open = logi_dj_input_open;
+	input->close = logi_dj_input_close;
+	input->event = logi_dj_kbd_event;
+	input_set_drvdata(input, dj_dev);
+
+	for (i = 0; i < KBD_USAGES_COUNT; i++) {
+		if (logi_dj_kbd_keycode[i])
+			input_set_capability(input, EV_KEY,
+					     logi_dj_kbd_keycode[i]);
+	}
+	input_set_capability(input, EV_MSC, MSC_SCAN);
+	for (i = LED_NUML; i <= LED_KANA; i++)
+		input_set_capability(input, EV_LED, i);
+	__set_bit(EV_REP, input->evbit);
+
+	return input;
+}
+
+static void logi_dj_kbd_report_keys(struct input_dev *input,
+				    unsigned long *keys, int word,
+				    unsigned long changed)
+{
+	unsigned int usage;
+	int bit;
+
+	while (changed) {
+		bit = __ffs(changed);
+		changed &= changed - 1;
+
+		usage = word * BITS_PER_LONG + bit;
+		input_event(input, EV_MSC, MSC_SCAN, HID_UP_KEYBOARD | usage);
+		input_report_key(input, logi_dj_kbd_keycode[usage],
+				 test_bit(usage, keys));
+	}
+}
+
+static void logi_dj_kbd_report(struct dj_device *dj_dev, u8 *data)
+{
+	/* data follows kbd_descriptor, data[0] being the report id */
+	DECLARE_BITMAP(keys, KBD_USAGES_COUNT);
+	unsigned long *old_keys = dj_dev->kbd_keys;
+	u8 usage;
+	int i;
+
+	/* Phantom state: keep the current keys, as hid-core does */
+	for (i = 0; i < KBD_KEYS_COUNT; i++) {
+		if (data[KBD_REPORT_KEYS + i] == KBD_USAGE_ERROR_ROLLOVER)
+			return;
+	}
+
+	bitmap_zero(keys, KBD_USAGES_COUNT);
+	for (i = 0; i < 8; i++) {
+		if (data[KBD_REPORT_MODIFIERS] & (1 << i))
+			__set_bit(KBD_USAGE_LEFT_CONTROL + i, keys);
+	}
+	for (i = 0; i < KBD_KEYS_COUNT; i++) {
+		usage = data[KBD_REPORT_KEYS + i];
+		if (logi_dj_kbd_keycode[usage])
+			__set_bit(usage, keys);
+	}
+
+	/* Key array releases, modifier releases, modifier presses, then key
+	 * array presses, each in usage order: Shift+A in one report must
+	 * give KEY_LEFTSHIFT before KEY_A, as with hid-core */
+	for (i = 0; i < BITS_TO_LONGS(KBD_USAGES_COUNT); i++)
+		logi_dj_kbd_report_keys(dj_dev->kbd_input, keys, i,
+			old_keys[i] & ~keys[i] &
+			~(i == KBD_MODIFIERS_WORD ? KBD_MODIFIERS_MASK : 0));
+	logi_dj_kbd_report_keys(dj_dev->kbd_input, keys, KBD_MODIFIERS_WORD,
+		old_keys[KBD_MODIFIERS_WORD] & ~keys[KBD_MODIFIERS_WORD] &
+		KBD_MODIFIERS_MASK);
+	logi_dj_kbd_report_keys(dj_dev->kbd_input, keys, KBD_MODIFIERS_WORD,
+		keys[KBD_MODIFIERS_WORD] & ~old_keys[KBD_MODIFIERS_WORD] &
+		KBD_MODIFIERS_MASK);
+	for (i = 0; i < BITS_TO_LONGS(KBD_USAGES_COUNT); i++)
+		logi_dj_kbd_report_keys(dj_dev->kbd_input, keys, i,
+			keys[i] & ~old_keys[i] &
+			~(i == KBD_MODIFIERS_WORD ? KBD_MODIFIERS_MASK : 0));
+
+	bitmap_copy(old_keys, keys, KBD_USAGES_COUNT);
+
+	input_sync(dj_dev->kbd_input);
+}
+
+static struct input_dev *logi_dj_mouse_alloc(struct dj_device *dj_dev)
+{
+	struct hid_device *hdev = dj_dev->hdev;
+	struct input_dev *input;
+	int i;
+
+	input = input_allocate_device();
+	if (!input)
+		return NULL;
+
+	input->name = hdev->name;
+	input->phys = hdev->phys;
+	input->uniq = hdev->uniq;
+	input->id.bustype = hdev->bus;
+	input->id.vendor = hdev->vendor;
+	input->id.product = hdev->product;
+	input->dev.parent = &hdev->dev;
+	input->open = logi_dj_input_open;
+	input->close = logi_dj_input_close;
+	input_set_drvdata(input, dj_dev);
+
+	for (i = 0; i < MOUSE_BUTTONS_COUNT; i++)
+		input_set_capability(input, EV_KEY, BTN_MOUSE + i);
+	input_set_capability(input, EV_REL, REL_X);
+	input_set_capability(input, EV_REL, REL_Y);
+	input_set_capability(input, EV_REL, REL_WHEEL);
+	input_set_capability(input, EV_REL, REL_HWHEEL);
+	if (hires_scroll)
+		input_set_capability(input, EV_REL, REL_WHEEL_HI_RES);
+
+	return input;
+}
+
+static void logi_dj_mouse_report_wheel(struct dj_device *dj_dev, s8 wheel)
+{
+	/* We are called from atomic context (tasklet && djrcv->lock held) */
+	struct input_dev *input = dj_dev->mouse_input;
+	int multiplier = dj_dev->hires_multiplier;
+
+	if (!multiplier) {
+		input_report_rel(input, REL_WHEEL, wheel);
+		if (hires_scroll)
+			input_report_rel(input, REL_WHEEL_HI_RES,
+					 wheel * DJ_WHEEL_HI_RES_UNIT);
+		return;
+	}
+
+	if (!wheel)
+		return;
+
+	input_report_rel(input, REL_WHEEL_HI_RES,
+			 wheel * DJ_WHEEL_HI_RES_UNIT / multiplier);
+
+	/* Whole detents only for the legacy axis */
+	dj_dev->hires_remainder += wheel;
+	input_report_rel(input, REL_WHEEL,
+			 dj_dev->hires_remainder / multiplier);
+	dj_dev->hires_remainder %= multiplier;
+}
+
+static void logi_dj_mouse_report(struct dj_device *dj_dev, u8 *data)
+{
+	/* data follows mse_descriptor, data[0] being the report id */
+	struct input_dev *input = dj_dev->mouse_input;
+	u16 buttons = get_unaligned_le16(&data[MOUSE_REPORT_BUTTONS]);
+	u8 *xy = &data[MOUSE_REPORT_XY];
+	int i;
+
+	for (i = 0; i < MOUSE_BUTTONS_COUNT; i++)
+		input_report_key(input, BTN_MOUSE + i, buttons & (1 << i));
+
+	input_report_rel(input, REL_X,
+			 sign_extend32(xy[0] | (xy[1] & 0x0f) << 8, 11));
+	input_report_rel(input, REL_Y,
+			 sign_extend32((xy[1] >> 4) | xy[2] << 4, 11));
+	logi_dj_mouse_report_wheel(dj_dev, (s8)data[MOUSE_REPORT_WHEEL]);
+	input_report_rel(input, REL_HWHEEL, (s8)data[MOUSE_REPORT_AC_PAN]);
+
+	input_sync(input);
+}
+
+static void logi_dj_recv_free_djhid_device(struct dj_device *dj_dev)
+{
+	if (dj_dev->kbd_input)
+		input_unregister_device(dj_dev->kbd_input);
+	if (dj_dev->mouse_input)
+		input_unregister_device(dj_dev->mouse_input);
+	if (dj_dev->aggregated) {
+		clear_bit(dj_dev->device_index,
+			  &dj_dev->dj_receiver_dev->aggregate_kbd_slots);
+	} else {
+		sysfs_remove_group(&dj_dev->hdev->dev.kobj,
+				   &logi_dj_device_attr_group);
+		hid_destroy_device(dj_dev->hdev);
+	}
+	kfree(dj_dev->filter);
+	kfree(dj_dev);
+}
+
+static void logi_dj_recv_free_aggregates(struct dj_receiver_dev *djrcv_dev)
+{
+	/* Called once all the aggregated devices are gone */
+	struct dj_device *aggregate_dev;
+	int i;
+
+	for (i = 0; i < DJ_AGGREGATE_CLASSES; i++) {
+		aggregate_dev = djrcv_dev->aggregate_devs[i];
+		if (!aggregate_dev)
+			continue;
+
+		hid_destroy_device(aggregate_dev->hdev);
+		djrcv_dev->aggregate_devs[i] = NULL;
+		kfree(aggregate_dev);
+	}
+}
+
+static void logi_dj_recv_destroy_djhid_device(struct dj_receiver_dev *djrcv_dev,
+						struct dj_report *dj_report)
+{
+	/* Called in delayed work context */
+	struct dj_device *dj_dev;
+	unsigned long flags;
+
+	spin_lock_irqsave(&djrcv_dev->lock, flags);
+	dj_dev = djrcv_dev->paired_dj_devices[dj_report->device_index];
+	/* The aggregate devices outlive it, release what it holds there */
+	if (dj_dev && dj_dev->aggregated)
+		logi_dj_recv_forward_null_report(djrcv_dev, dj_report);
+	djrcv_dev->paired_dj_devices[dj_report->device_index] = NULL;
+	djrcv_dev->pairing_info[dj_report->device_index].valid = false;
+	spin_unlock_irqrestore(&djrcv_dev->lock, flags);
+
+	if (dj_dev != NULL) {
+		logi_dj_recv_free_djhid_device(dj_dev);
+	} else {
+		dev_err(&djrcv_dev->hdev->dev, "%s: can't destroy a NULL device\n",
+			__func__);
+	}
+}
+
+static void logi_dj_recv_add_phase(struct dj_receiver_dev *djrcv_dev,
+				   u8 device_index, int phase, ktime_t time)
+{
+	/* Called in delayed work context */
+	ktime_t *timing = djrcv_dev->add_timing[device_index];
+
+	if (phase == DJ_ADD_QUEUED)
+		memset(timing, 0, sizeof(djrcv_dev->add_timing[0]));
+
+	timing[phase] = time;
+	trace_logi_dj_add_phase(djrcv_dev->hdev, device_index,
+				dj_add_phase_names[phase],
+				ktime_to_ns(ktime_sub(time,
+						      timing[DJ_ADD_QUEUED])));
+}
+
+static bool logi_dj_is_wtp(u16 wpid)
+{
+	/* Without a driver for the WTP group, touchpads stay generic mice */
+	int i;
+
+	if (!wtp_group)
+		return false;
+
+	for (i = 0; i < ARRAY_SIZE(logi_dj_wtp_wpids); i++) {
+		if (logi_dj_wtp_wpids[i] == wpid)
+			return true;
+	}
+
+	return false;
+}
+
+static struct dj_device *
+logi_dj_recv_create_aggregate(struct dj_receiver_dev *djrcv_dev, int class)
+{
+	/* Called in delayed work context */
+	struct hid_device *djrcv_hdev = djrcv_dev->hdev;
+	struct hid_device *dj_hiddev;
+	struct dj_device *dj_dev;
+	char tmpstr[6];
+
+	dj_hiddev = hid_allocate_device();
+	if (IS_ERR(dj_hiddev)) {
+		dev_err(&djrcv_hdev->dev, "%s: hid_allocate_device failed\n",
+			__func__);
+		return NULL;
+	}
+
+	dj_hiddev->ll_driver = &logi_dj_ll_driver;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 15, 0)
+	dj_hiddev->hid_output_raw_report = logi_dj_output_hidraw_report;
+#endif
+
+	dj_hiddev->dev.parent = &djrcv_hdev->dev;
+	dj_hiddev->bus = djrcv_hdev->bus;
+	dj_hiddev->vendor = djrcv_hdev->vendor;
+	dj_hiddev->product = djrcv_hdev->product;
+	dj_hiddev->group = HID_GROUP_LOGITECH_DJ_DEVICE_GENERIC;
+	snprintf(dj_hiddev->name, sizeof(dj_hiddev->name),
+		 "Logitech Unifying %s", logi_dj_aggregate_names[class]);
+
+	djrcv_dev->transport->make_path(djrcv_hdev, dj_hiddev->phys,
+					sizeof(dj_hiddev->phys));
+	snprintf(tmpstr, sizeof(tmpstr), ":0.%d", class);
+	strlcat(dj_hiddev->phys, tmpstr, sizeof(dj_hiddev->phys));
+
+	dj_dev = kzalloc(sizeof(struct dj_device), GFP_KERNEL);
+	if (!dj_dev) {
+		dev_err(&djrcv_hdev->dev, "%s: failed allocating dj_device\n",
+			__func__);
+		hid_destroy_device(dj_hiddev);
+		return NULL;
+	}
+
+	dj_dev->reports_supported = logi_dj_aggregate_reports[class];
+	dj_dev->hdev = dj_hiddev;
+	dj_dev->dj_receiver_dev = djrcv_dev;
+	dj_dev->link_state = DJ_LINK_UNKNOWN;
+	dj_hiddev->driver_data = dj_dev;
+
+	if (hid_add_device(dj_hiddev)) {
+		dev_err(&djrcv_hdev->dev, "%s: failed adding aggregate device\n",
+			__func__);
+		kfree(dj_dev);
+		hid_destroy_device(dj_hiddev);
+		return NULL;
+	}
+
+	return dj_dev;
+}
+
+static void logi_dj_recv_add_aggregated_device(struct dj_receiver_dev *djrcv_dev,
+					       struct dj_report *dj_report,
+					       u16 wpid)
+{
+	/* Called in delayed work context */
+	struct dj_pairing_info *info =
+		&djrcv_dev->pairing_info[dj_report->device_index];
+	struct dj_device *aggregate_dev;
+	struct dj_device *dj_dev;
+	u32 reports_supported;
+	unsigned long flags;
+	int i;
+
+	reports_supported = get_unaligned_le32(
+		dj_report->report_params + DEVICE_PAIRED_RF_REPORT_TYPE);
+
+	/* The aggregate devices are only created when a device needs them,
+	 * to not show inputs without any device behind them. If that fails,
+	 * hid-core drops the reports of the class */
+	for (i = 0; i < DJ_AGGREGATE_CLASSES; i++) {
+		if (djrcv_dev->aggregate_devs[i] ||
+		    !(reports_supported & logi_dj_aggregate_reports[i]))
+			continue;
+
+		aggregate_dev = logi_dj_recv_create_aggregate(djrcv_dev, i);
+		if (!aggregate_dev)
+			continue;
+
+		spin_lock_irqsave(&djrcv_dev->lock, flags);
+		djrcv_dev->aggregate_devs[i] = aggregate_dev;
+		spin_unlock_irqrestore(&djrcv_dev->lock, flags);
+	}
+
+	dj_dev = kzalloc(sizeof(struct dj_device), GFP_KERNEL);
+	if (!dj_dev) {
+		dev_err(&djrcv_dev->hdev->dev,
+			"%s: failed allocating dj_device\n", __func__);
+		return;
+	}
+
+	dj_dev->reports_supported = reports_supported;
+	dj_dev->dj_receiver_dev = djrcv_dev;
+	dj_dev->device_index = dj_report->device_index;
+	dj_dev->wpid = wpid;
+	if (info->has_name)
+		strlcpy(dj_dev->name, info->name, sizeof(dj_dev->name));
+	dj_dev->aggregated = true;
+	dj_dev->link_state = DJ_LINK_UNKNOWN;
+	dj_dev->link_changed = ktime_get();
+
+	if (dj_dev->reports_supported & STD_KEYBOARD)
+		set_bit(dj_dev->device_index, &djrcv_dev->aggregate_kbd_slots);
+
+	djrcv_dev->paired_dj_devices[dj_report->device_index] = dj_dev;
+
+	logi_dj_recv_add_phase(djrcv_dev, dj_report->device_index,
+			       DJ_ADD_DONE, ktime_get());
+}
+
+static void logi_dj_recv_add_djhid_device(struct dj_receiver_dev *djrcv_dev,
+					  struct dj_report *dj_report)
+{
+	/* Called in delayed work context */
+	struct hid_device *djrcv_hdev = djrcv_dev->hdev;
+	struct hid_device *dj_hiddev;
+	struct dj_device *dj_dev;
+	struct dj_pairing_info *info;
+	u16 wpid;
+
+	/* Device index goes from 1 to 6, we need 3 bytes to store the
+	 * semicolon, the index, and a null terminator
+	 */
+	unsigned char tmpstr[3];
+
+	if (dj_report->report_params[DEVICE_PAIRED_PARAM_SPFUNCTION] &
+	    SPFUNCTION_DEVICE_LIST_EMPTY) {
+		dbg_hid("%s: device list is empty\n", __func__);
+		djrcv_dev->querying_devices = false;
+		return;
+	}
+
+	if ((dj_report->device_index < DJ_DEVICE_INDEX_MIN) ||
+	    (dj_report->device_index > DJ_DEVICE_INDEX_MAX)) {
+		dev_err(&djrcv_hdev->dev, "%s: invalid device index:%d\n",
+			__func__, dj_report->device_index);
+		return;
+	}
+
+	if (djrcv_dev->paired_dj_devices[dj_report->device_index]) {
+		/* The device is already known. No need to reallocate it. */
+		dbg_hid("%s: device is already known\n", __func__);
+		return;
+	}
+
+	logi_dj_recv_add_phase(djrcv_dev, dj_report->device_index,
+			       DJ_ADD_QUEUED, djrcv_dev->notif_queued);
+	logi_dj_recv_add_phase(djrcv_dev, dj_report->device_index,
+			       DJ_ADD_STARTED, djrcv_dev->notif_started);
+
+	/* Read the names and serials of all the paired devices at once */
+	info = &djrcv_dev->pairing_info[dj_report->device_index];
+	if (!info->valid)
+		logi_dj_recv_fetch_pairing_info(djrcv_dev);
+
+	logi_dj_recv_add_phase(djrcv_dev, dj_report->device_index,
+			       DJ_ADD_PAIRING_INFO, ktime_get());
+
+	wpid = (dj_report->report_params[DEVICE_PAIRED_PARAM_EQUAD_ID_MSB] << 8) |
+		dj_report->report_params[DEVICE_PAIRED_PARAM_EQUAD_ID_LSB];
+
+	/* Touchpads keep their own node, see below */
+	if (djrcv_dev->aggregate && !logi_dj_is_wtp(wpid)) {
+		logi_dj_recv_add_aggregated_device(djrcv_dev, dj_report, wpid);
+		return;
+	}
+
+	dj_hiddev = hid_allocate_device();
+	if (IS_ERR(dj_hiddev)) {
+		dev_err(&djrcv_hdev->dev, "%s: hid_allocate_device failed\n",
+			__func__);
+		return;
+	}
+
+	dj_hiddev->ll_driver = &logi_dj_ll_driver;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 15, 0)
+	dj_hiddev->hid_output_raw_report = logi_dj_output_hidraw_report;
+#endif
+
+	dj_hiddev->dev.parent = &djrcv_hdev->dev;
+	dj_hiddev->bus = djrcv_hdev->bus;
+	dj_hiddev->vendor = djrcv_hdev->vendor;
+	dj_hiddev->product = wpid;
+	if (info->has_name)
+		snprintf(dj_hiddev->name, sizeof(dj_hiddev->name),
+			"Logitech %s", info->name);
+	else
+		snprintf(dj_hiddev->name, sizeof(dj_hiddev->name),
+			"Logitech Unifying Device. Wireless PID:%04x",
+			dj_hiddev->product);
+	if (info->has_serial)
+		snprintf(dj_hiddev->uniq, sizeof(dj_hiddev->uniq), "%08x",
+			 info->serial);
+
+	/* Touchpads are left to a multitouch driver, which needs the raw
+	 * HID++ reports */
+	if (logi_dj_is_wtp(dj_hiddev->product))
+		dj_hiddev->group = HID_GROUP_LOGITECH_DJ_DEVICE_WTP;
+	else
+		dj_hiddev->group = HID_GROUP_LOGITECH_DJ_DEVICE_GENERIC;
+	dj_hiddev->product = djrcv_hdev->product;
+
+	djrcv_dev->transport->make_path(djrcv_hdev, dj_hiddev->phys,
+					sizeof(dj_hiddev->phys));
+	snprintf(tmpstr, sizeof(tmpstr), ":%d", dj_report->device_index);
+	strlcat(dj_hiddev->phys, tmpstr, sizeof(dj_hiddev->phys));
+
+	dj_dev = kzalloc(sizeof(struct dj_device), GFP_KERNEL);
+
+	if (!dj_dev) {
+		dev_err(&djrcv_hdev->dev, "%s: failed allocating dj_device\n",
+			__func__);
+		goto dj_device_allocate_fail;
+	}
+
+	dj_dev->reports_supported = get_unaligned_le32(
+		dj_report->report_params + DEVICE_PAIRED_RF_REPORT_TYPE);
+	dj_dev->hdev = dj_hiddev;
+	dj_dev->dj_receiver_dev = djrcv_dev;
+	dj_dev->device_index = dj_report->device_index;
+	dj_dev->wpid = wpid;
+	if (info->has_name)
+		strlcpy(dj_dev->name, info->name, sizeof(dj_dev->name));
+	dj_dev->link_state = DJ_LINK_UNKNOWN;
+	dj_dev->link_changed = ktime_get();
+	dj_dev->hidpp_subscribed =
+		dj_hiddev->group == HID_GROUP_LOGITECH_DJ_DEVICE_WTP;
+	dj_hiddev->driver_data = dj_dev;
+
+	/* Must be known before hid_add_device() parses the descriptors */
+	if (kbd_fastpath && (dj_dev->reports_supported & STD_KEYBOARD))
+		dj_dev->kbd_input = logi_dj_kbd_alloc(dj_dev);
+	if ((mouse_fastpath || hires_scroll) &&
+	    (dj_dev->reports_supported & STD_MOUSE))
+		dj_dev->mouse_input = logi_dj_mouse_alloc(dj_dev);
+
+	djrcv_dev->paired_dj_devices[dj_report->device_index] = dj_dev;
+
+	if (hid_add_device(dj_hiddev)) {
+		dev_err(&djrcv_hdev->dev, "%s: failed adding dj_device\n",
+			__func__);
+		goto hid_add_device_fail;
+	}
+
+	logi_dj_recv_add_phase(djrcv_dev, dj_report->device_index,
+			       DJ_ADD_HID_ADDED, ktime_get());
+
+	if (sysfs_create_group(&dj_hiddev->dev.kobj,
+			       &logi_dj_device_attr_group)) {
+		dev_err(&djrcv_hdev->dev, "%s: failed creating sysfs group\n",
+			__func__);
+		goto hid_add_device_fail;
+	}
+
+	if (dj_dev->kbd_input && input_register_device(dj_dev->kbd_input)) {
+		dev_err(&djrcv_hdev->dev, "%s: failed registering kbd input\n",
+			__func__);
+		goto kbd_input_register_fail;
+	}
+
+	if (dj_dev->mouse_input && input_register_device(dj_dev->mouse_input)) {
+		dev_err(&djrcv_hdev->dev, "%s: failed registering mouse input\n",
+			__func__);
+		goto mouse_input_register_fail;
+	}
+
+	logi_dj_recv_add_phase(djrcv_dev, dj_report->device_index,
+			       DJ_ADD_DONE, ktime_get());
+
+	if (hires_scroll && dj_dev->mouse_input)
+		logi_dj_dev_enable_hires(dj_dev);
+
+	return;
+
+mouse_input_register_fail:
+	if (dj_dev->kbd_input) {
+		input_unregister_device(dj_dev->kbd_input);
+		dj_dev->kbd_input = NULL;
+	}
+kbd_input_register_fail:
+	sysfs_remove_group(&dj_hiddev->dev.kobj, &logi_dj_device_attr_group);
+hid_add_device_fail:
+	djrcv_dev->paired_dj_devices[dj_report->device_index] = NULL;
+	if (dj_dev->kbd_input)
+		input_free_device(dj_dev->kbd_input);
+	if (dj_dev->mouse_input)
+		input_free_device(dj_dev->mouse_input);
+	kfree(dj_dev);
+dj_device_allocate_fail:
+	hid_destroy_device(dj_hiddev);
+}
+
+static void logi_dj_recv_notify_link_state(struct dj_receiver_dev *djrcv_dev,
+					   u8 device_index)
+{
+	/* Called in delayed work context, the only one destroying devices */
+	struct dj_device *dj_dev;
+	unsigned long flags;
+	u8 link_state;
+
+	dj_dev = djrcv_dev->paired_dj_devices[device_index];
+	if (!dj_dev)
+		return;
+
+	spin_lock_irqsave(&djrcv_dev->lock, flags);
+	link_state = dj_dev->link_state;
+	spin_unlock_irqrestore(&djrcv_dev->lock, flags);
+
+	if (!dj_dev->aggregated)
+		sysfs_notify(&dj_dev->hdev->dev.kobj, NULL, "link_state");
+
+	if (link_state != DJ_LINK_CONNECTED)
+		return;
+
+	/* The wheel mode and report rate do not survive a power cycle of
+	 * the device */
+	if (hires_scroll && dj_dev->mouse_input &&
+	    (!dj_dev->hires_multiplier || dj_dev->hires_stale))
+		logi_dj_dev_enable_hires(dj_dev);
+
+	if (dj_dev->report_rate_ms &&
+	    logi_dj_dev_set_report_rate(dj_dev, dj_dev->report_rate_ms))
+		dev_err(&dj_dev->hdev->dev,
+			"%s: failed restoring the report rate\n", __func__);
+}
+
+static bool logi_dj_recv_notify_link_changes(struct dj_receiver_dev *djrcv_dev)
+{
+	/* Called in delayed work context. Returns true if a link changed */
+	bool changed = false;
+	int i;
+
+	for (i = DJ_DEVICE_INDEX_MIN; i <= DJ_DEVICE_INDEX_MAX; i++) {
+		if (!test_and_clear_bit(i, &djrcv_dev->link_changes))
+			continue;
+
+		logi_dj_recv_notify_link_state(djrcv_dev, i);
+		changed = true;
+	}
+
+	return changed;
+}
+
+static void logi_dj_recv_schedule_work(struct dj_receiver_dev *djrcv_dev)
+{
+	/* We are called with djrcv->lock held */
+	if (schedule_work(&djrcv_dev->work) == 0) {
+		dbg_hid("%s: did not schedule the work item, was already "
+			"queued\n", __func__);
+		return;
+	}
+
+	djrcv_dev->work_queued = ktime_get();
+}
+
+static void delayedwork_callback(struct work_struct *work)
+{
+	struct dj_receiver_dev *djrcv_dev =
+		container_of(work, struct dj_receiver_dev, work);
+
+	struct dj_report dj_report;
+	unsigned long flags;
+	bool link_changes;
+	int count;
+	int retval;
+
+	dbg_hid("%s\n", __func__);
+
+	link_changes = logi_dj_recv_notify_link_changes(djrcv_dev);
+
+	spin_lock_irqsave(&djrcv_dev->lock, flags);
+
+	count = kfifo_out(&djrcv_dev->notif_fifo, &dj_report,
+				sizeof(struct dj_report));
+
+	if (count != sizeof(struct dj_report)) {
+		if (!link_changes)
+			dev_err(&djrcv_dev->hdev->dev, "%s: workitem triggered "
+				"without notifications available\n", __func__);
+		spin_unlock_irqrestore(&djrcv_dev->lock, flags);
+		return;
+	}
+
+	djrcv_dev->notif_queued = djrcv_dev->work_queued;
+	djrcv_dev->notif_started = ktime_get();
+
+	if (!kfifo_is_empty(&djrcv_dev->notif_fifo))
+		logi_dj_recv_schedule_work(djrcv_dev);
+
+	spin_unlock_irqrestore(&djrcv_dev->lock, flags);
+
+	switch (dj_report.report_type) {
+	case REPORT_TYPE_NOTIF_DEVICE_PAIRED:
+		logi_dj_recv_add_djhid_device(djrcv_dev, &dj_report);
+		break;
+	case REPORT_TYPE_NOTIF_DEVICE_UNPAIRED:
+		logi_dj_recv_destroy_djhid_device(djrcv_dev, &dj_report);
+		break;
+	default:
+	/* A normal report (i. e. not belonging to a pair/unpair notification)
+	 * arriving here, means that the report arrived but we did not have a
+	 * paired dj_device associated to the report's device_index, this
+	 * means that the original "device paired" notification corresponding
+	 * to this dj_device never arrived to this driver. The reason is that
+	 * hid-core discards all packets coming from a device while probe() is
+	 * executing. */
+	if (!djrcv_dev->paired_dj_devices[dj_report.device_index]) {
+		/* ok, we don't know the device, just re-ask the
+		 * receiver for the list of connected devices. */
+		retval = logi_dj_recv_query_paired_devices(djrcv_dev);
+		if (!retval) {
+			/* everything went fine, so just leave */
+			break;
+		}
+		dev_err(&djrcv_dev->hdev->dev,
+			"%s:logi_dj_recv_query_paired_devices "
+			"error:%d\n", __func__, retval);
+		}
+		dbg_hid("%s: unexpected report type\n", __func__);
+	}
+}
+
+static void logi_dj_recv_queue_notification(struct dj_receiver_dev *djrcv_dev,
+					   struct dj_report *dj_report)
+{
+	/* We are called from atomic context (tasklet && djrcv->lock held) */
+
+	if (kfifo_avail(&djrcv_dev->notif_fifo) < sizeof(struct dj_report)) {
+		dev_warn(&djrcv_dev->hdev->dev,
+			 "%s: kfifo full, notification type %d of index %d "
+			 "dropped\n", __func__, dj_report->report_type,
+			 dj_report->device_index);
+		return;
+	}
+
+	kfifo_in(&djrcv_dev->notif_fifo, dj_report, sizeof(struct dj_report));
+
+	logi_dj_recv_schedule_work(djrcv_dev);
+}
+
+static void logi_dj_recv_set_link_state(struct dj_receiver_dev *djrcv_dev,
+					struct dj_device *dj_dev, u8 link_state,
+					ktime_t timestamp)
+{
+	/* We are called from atomic context (tasklet && djrcv->lock held) */
+	if (dj_dev->link_state == link_state)
+		return;
+
+	dj_dev->link_state = link_state;
+	dj_dev->link_changed = timestamp;
+
+	if (link_state == DJ_LINK_DISCONNECTED)
+		dj_dev->hires_stale = true;
+
+	/* sysfs_notify() can not be called from here, let the work item
+	 * wake up the pollers. Changes are coalesced, they must not take the
+	 * room of pairing notifications in notif_fifo */
+	set_bit(dj_dev->device_index, &djrcv_dev->link_changes);
+	logi_dj_recv_schedule_work(djrcv_dev);
+}
+
+static void logi_dj_recv_update_link_state(struct dj_receiver_dev *djrcv_dev,
+					   struct dj_report *dj_report,
+					   ktime_t timestamp)
+{
+	/* We are called from atomic context (tasklet && djrcv->lock held) */
+	struct dj_device *dj_dev;
+
+	if ((dj_report->device_index < DJ_DEVICE_INDEX_MIN) ||
+	    (dj_report->device_index > DJ_DEVICE_INDEX_MAX))
+		return;
+
+	dj_dev = djrcv_dev->paired_dj_devices[dj_report->device_index];
+	if (!dj_dev)
+		return;
+
+	if (dj_report->report_params[CONNECTION_STATUS_PARAM_STATUS] ==
+	    STATUS_LINKLOSS)
+		logi_dj_recv_set_link_state(djrcv_dev, dj_dev,
+					    DJ_LINK_DISCONNECTED, timestamp);
+	else
+		logi_dj_recv_set_link_state(djrcv_dev, dj_dev,
+					    DJ_LINK_CONNECTED, timestamp);
+}
+
+static struct hid_device *logi_dj_dev_report_hdev(struct dj_device *dj_dev,
+						  u8 report_type)
+{
+	/* We are called from atomic context (tasklet && djrcv->lock held).
+	 * Device the reports of type report_type go to, NULL if none */
+	struct dj_device **aggregate_devs;
+	int i;
+
+	if (!dj_dev->aggregated)
+		return dj_dev->hdev;
+
+	aggregate_devs = dj_dev->dj_receiver_dev->aggregate_devs;
+	for (i = 0; i < DJ_AGGREGATE_CLASSES; i++) {
+		if ((logi_dj_aggregate_reports[i] & (1 << report_type)) &&
+		    aggregate_devs[i])
+			return aggregate_devs[i]->hdev;
+	}
+
+	return NULL;
+}
+
+static int logi_dj_dev_input_report(struct dj_device *dj_dev, u8 *data,
+				    int size)
+{
+	/* We are called from atomic context (tasklet && djrcv->lock held) */
+	struct hid_device *hdev;
+
+	switch (data[0]) {
+	case REPORT_TYPE_KEYBOARD:
+		if (dj_dev->kbd_input) {
+			logi_dj_kbd_report(dj_dev, data);
+			return 0;
+		}
+		break;
+	case REPORT_TYPE_MOUSE:
+		if (dj_dev->mouse_input) {
+			logi_dj_mouse_report(dj_dev, data);
+			return 0;
+		}
+		break;
+	}
+
+	hdev = logi_dj_dev_report_hdev(dj_dev, data[0]);
+	if (!hdev)
+		return -ENODEV;
+
+	return hid_input_report(hdev, HID_INPUT_REPORT, data, size, 1);
+}
+
+static bool logi_dj_dev_report_is_repeat(struct dj_device *dj_dev, u8 *data,
+					 int size)
+{
+	/* We are called from atomic context (tasklet && djrcv->lock held) */
+	u8 *last;
+
+	switch (data[0]) {
+	case REPORT_TYPE_KEYBOARD:
+	case REPORT_TYPE_CONSUMER_CONTROL:
+	case REPORT_TYPE_SYSTEM_CONTROL:
+	case REPORT_TYPE_MEDIA_CENTER:
+		break;
+	default:
+		return false;
+	}
+
+	last = dj_dev->last_reports[data[0]];
+	if ((dj_dev->last_reports_valid & (1 << data[0])) &&
+	    !memcmp(last, data, size))
+		return true;
+
+	memcpy(last, data, size);
+	dj_dev->last_reports_valid |= 1 << data[0];
+
+	return false;
+}
+
+static void logi_dj_recv_forward_null_report(struct dj_receiver_dev *djrcv_dev,
+					     struct dj_report *dj_report)
+{
+	/* We are called from atomic context (tasklet && djrcv->lock held) */
+	unsigned int i;
+	u8 reportbuffer[MAX_REPORT_SIZE];
+	struct dj_device *djdev;
+
+	djdev = djrcv_dev->paired_dj_devices[dj_report->device_index];
+
+	if (!djdev) {
+		dbg_hid("djrcv_dev->paired_dj_devices[dj_report->device_index]"
+			" is NULL, index %d\n", dj_report->device_index);
+		logi_dj_recv_queue_notification(djrcv_dev, dj_report);
+		return;
+	}
+
+	memset(reportbuffer, 0, sizeof(reportbuffer));
+
+	/* The state is reset, whatever comes next must go through */
+	djdev->last_reports_valid = 0;
+
+	for (i = 0; i < NUMBER_OF_HID_REPORTS; i++) {
+		if (djdev->reports_supported & (1 << i)) {
+			reportbuffer[0] = i;
+			if (logi_dj_dev_input_report(djdev, reportbuffer,
+						     hid_reportid_size_map[i])) {
+				dbg_hid("hid_input_report error sending null "
+					"report\n");
+			}
+		}
+	}
+}
+
+static void logi_dj_dev_update_latency(struct dj_device *dj_dev,
+				       ktime_t timestamp)
+{
+	/* We are called from atomic context (tasklet && djrcv->lock held) */
+	s64 latency = ktime_to_ns(ktime_sub(ktime_get(), timestamp));
+
+	dj_dev->delivery_latency_last = latency;
+	if (latency > dj_dev->delivery_latency_max)
+		dj_dev->delivery_latency_max = latency;
+	dj_dev->delivery_latency_sum += latency;
+	dj_dev->delivery_count++;
+}
+
+static void logi_dj_recv_update_intervals(struct dj_interval_histogram *hist,
+					  ktime_t timestamp)
+{
+	/* We are called from atomic context (tasklet && djrcv->lock held) */
+	s64 now = ktime_to_ns(timestamp);
+
+	if (likely(hist->last_ns))
+		hist->buckets[min(fls64(now - hist->last_ns),
+				  DJ_INTERVAL_BUCKETS - 1)]++;
+	hist->last_ns = now;
+}
+
+static void logi_dj_recv_forward_report(struct dj_receiver_dev *djrcv_dev,
+					struct dj_report *dj_report,
+					ktime_t timestamp)
+{
+	/* We are called from atomic context (tasklet && djrcv->lock held),
+	 * timestamp is the arrival time of the report in raw_event */
+	struct dj_device *dj_device;
+
+	dj_device = djrcv_dev->paired_dj_devices[dj_report->device_index];
+
+	if (dj_device == NULL) {
+		dbg_hid("djrcv_dev->paired_dj_devices[dj_report->device_index]"
+			" is NULL, index %d\n", dj_report->device_index);
+		logi_dj_recv_queue_notification(djrcv_dev, dj_report);
+		return;
+	}
+
+	logi_dj_recv_update_intervals(
+		&djrcv_dev->intervals[dj_report->device_index], timestamp);
+
+	/* The device talks to us, so the link is up */
+	if (unlikely(dj_device->link_state != DJ_LINK_CONNECTED))
+		logi_dj_recv_set_link_state(djrcv_dev, dj_device,
+					    DJ_LINK_CONNECTED, timestamp);
+
+	if ((dj_report->report_type > ARRAY_SIZE(hid_reportid_size_map) - 1) ||
+	    (hid_reportid_size_map[dj_report->report_type] == 0)) {
+		dbg_hid("invalid report type:%x\n", dj_report->report_type);
+		return;
+	}
+
+	if (!suppress_repeats) {
+		/* The cache goes stale as soon as we stop updating it */
+		dj_device->last_reports_valid = 0;
+	} else if (logi_dj_dev_report_is_repeat(dj_device,
+			&dj_report->report_type,
+			hid_reportid_size_map[dj_report->report_type])) {
+		dj_device->suppressed_reports++;
+		return;
+	}
+
+	if (logi_dj_dev_input_report(dj_device, &dj_report->report_type,
+			hid_reportid_size_map[dj_report->report_type])) {
+		dbg_hid("hid_input_report error\n");
+	}
+
+	logi_dj_dev_update_latency(dj_device, timestamp);
+}
+
+static void logi_dj_filter_add_key(u8 usage, u8 *modifiers, u8 *keys,
+				   int *count)
+{
+	if (!usage)
+		return;
+
+	if (usage >= KBD_USAGE_LEFT_CONTROL && usage < KBD_USAGE_LEFT_CONTROL + 8)
+		*modifiers |= 1 << (usage - KBD_USAGE_LEFT_CONTROL);
+	else if (*count < KBD_KEYS_COUNT)
+		keys[(*count)++] = usage;
+}
+
+static void logi_dj_filter_keyboard(struct dj_report_filter *filter, u8 *data)
+{
+	/* data follows kbd_descriptor, data[0] being the report id */
+	u8 keys[KBD_KEYS_COUNT];
+	u8 modifiers = 0;
+	int i, count = 0;
+
+	/* Leave phantom state reports alone */
+	for (i = 0; i < KBD_KEYS_COUNT; i++) {
+		if (data[KBD_REPORT_KEYS + i] == KBD_USAGE_ERROR_ROLLOVER)
+			return;
+	}
+
+	memset(keys, 0, sizeof(keys));
+
+	for (i = 0; i < 8; i++) {
+		if (data[KBD_REPORT_MODIFIERS] & (1 << i))
+			logi_dj_filter_add_key(
+				filter->key_remap[KBD_USAGE_LEFT_CONTROL + i],
+				&modifiers, keys, &count);
+	}
+	for (i = 0; i < KBD_KEYS_COUNT; i++) {
+		if (data[KBD_REPORT_KEYS + i])
+			logi_dj_filter_add_key(
+				filter->key_remap[data[KBD_REPORT_KEYS + i]],
+				&modifiers, keys, &count);
+	}
+
+	data[KBD_REPORT_MODIFIERS] = modifiers;
+	memcpy(&data[KBD_REPORT_KEYS], keys, sizeof(keys));
+}
+
+static void logi_dj_filter_mouse(struct dj_report_filter *filter, u8 *data)
+{
+	/* data follows mse_descriptor, data[0] being the report id */
+	u16 buttons = get_unaligned_le16(&data[MOUSE_REPORT_BUTTONS]);
+	u16 remapped = 0;
+	int i;
+
+	for (i = 0; i < MOUSE_BUTTONS_COUNT; i++) {
+		if ((buttons & (1 << i)) && filter->button_remap[i])
+			remapped |= 1 << (filter->button_remap[i] - 1);
+	}
+
+	put_unaligned_le16(remapped, &data[MOUSE_REPORT_BUTTONS]);
+}
+
+static bool logi_dj_recv_filter_report(struct dj_receiver_dev *djrcv_dev,
+				       struct dj_report *dj_report)
+{
+	/* We are called from atomic context (tasklet && djrcv->lock held).
+	 * Returns false if the report must be dropped, the report may be
+	 * rewritten in place */
+	struct dj_device *dj_dev;
+	struct dj_report_filter *filter;
+
+	if ((dj_report->device_index < DJ_DEVICE_INDEX_MIN) ||
+	    (dj_report->device_index > DJ_DEVICE_INDEX_MAX))
+		return true;
+
+	dj_dev = djrcv_dev->paired_dj_devices[dj_report->device_index];
+	if (!dj_dev || likely(!dj_dev->filter))
+		return true;
+
+	filter = dj_dev->filter;
+
+	if (dj_report->report_type < 32 &&
+	    (filter->drop_types & (1 << dj_report->report_type)))
+		return false;
+
+	switch (dj_report->report_type) {
+	case REPORT_TYPE_KEYBOARD:
+		logi_dj_filter_keyboard(filter, &dj_report->report_type);
+		break;
+	case REPORT_TYPE_MOUSE:
+		logi_dj_filter_mouse(filter, &dj_report->report_type);
+		break;
+	}
+
+	return true;
+}
+
+static bool logi_dj_dev_hidpp_requested(struct dj_device *dj_dev,
+					u8 *data, int size)
+{
+	/* We are called from atomic context (tasklet && djrcv->lock held).
+	 * Returns true, and forgets the request, if data answers one of the
+	 * pending requests of dj_dev */
+	const u8 *match = &data[2];
+	unsigned int i;
+
+	if (size < HIDPP_REPORT_SHORT_LENGTH)
+		return false;
+
+	/* Errors carry the sub id and address of the request after theirs */
+	if ((data[2] == HIDPP_ERROR) || (data[2] == HIDPP20_ERROR))
+		match = &data[3];
+
+	for (i = 0; i < dj_dev->hidpp_nrequests; i++) {
+		if (!memcmp(dj_dev->hidpp_requests[i], match, 2))
+			break;
+	}
+	if (i == dj_dev->hidpp_nrequests)
+		return false;
+
+	dj_dev->hidpp_nrequests--;
+	memmove(dj_dev->hidpp_requests[i], dj_dev->hidpp_requests[i + 1],
+		(dj_dev->hidpp_nrequests - i) * 2);
+
+	return true;
+}
+
+static void logi_dj_dev_hidpp_request(struct dj_device *dj_dev, u8 *data)
+{
+	/* Called with djrcv->lock held, data being a HID++ request. The
+	 * oldest request is forgotten if too many are pending */
+	if (dj_dev->hidpp_nrequests == DJ_HIDPP_MAX_REQUESTS) {
+		dj_dev->hidpp_nrequests--;
+		memmove(dj_dev->hidpp_requests[0], dj_dev->hidpp_requests[1],
+			dj_dev->hidpp_nrequests * 2);
+	}
+
+	memcpy(dj_dev->hidpp_requests[dj_dev->hidpp_nrequests++], &data[2], 2);
+}
+
+static void logi_dj_recv_ring_hidpp(struct dj_receiver_dev *djrcv_dev,
+				    u8 *data, int size, ktime_t timestamp)
+{
+	/* We are called from atomic context (tasklet && djrcv->lock held) */
+	struct dj_hidpp_ring_header *header = djrcv_dev->hidpp_ring;
+	struct dj_hidpp_ring_frame *frame;
+	u32 head = djrcv_dev->hidpp_ring_head;
+
+	if (!djrcv_dev->hidpp_ring_open)
+		return;
+
+	if (head - ACCESS_ONCE(header->tail) >= djrcv_dev->hidpp_ring_nr) {
+		header->overflows++;
+		return;
+	}
+
+	frame = &djrcv_dev->hidpp_ring_frames[head &
+					      (djrcv_dev->hidpp_ring_nr - 1)];
+	frame->timestamp_ns = ktime_to_ns(timestamp);
+	frame->size = min_t(int, size, sizeof(frame->data));
+	memcpy(frame->data, data, frame->size);
+
+	/* The frame must be visible before the new head */
+	smp_wmb();
+	djrcv_dev->hidpp_ring_head = ++head;
+	header->head = head;
+
+	wake_up_interruptible(&djrcv_dev->hidpp_ring_wait);
+}
+
+static bool logi_dj_recv_forward_hidpp(struct dj_receiver_dev *djrcv_dev,
+			u8 *data, int size, bool answer, ktime_t timestamp)
+{
+	/* We are called from atomic context (tasklet && djrcv->lock held).
+	 * answer tells whether the report answers a query of the driver.
+	 * Returns true if the report must not reach the receiver's hidraw */
+
+	struct dj_device *dj_dev = NULL;
+	u8 device_index = data[1];
+
+	if (djrcv_dev->hidpp_ring)
+		logi_dj_recv_ring_hidpp(djrcv_dev, data, size, timestamp);
+
+	if ((device_index >= DJ_DEVICE_INDEX_MIN) &&
+	    (device_index <= DJ_DEVICE_INDEX_MAX))
+		dj_dev = djrcv_dev->paired_dj_devices[device_index];
+
+	/* The aggregate devices have no HID++ reports, they are only
+	 * available on the receiver node */
+	if (dj_dev && dj_dev->aggregated)
+		dj_dev = NULL;
+
+	if (!hidpp_routing) {
+		if (dj_dev) {
+			hid_input_report(dj_dev->hdev, HID_INPUT_REPORT, data,
+					 size, 1);
+			djrcv_dev->hidpp_delivered++;
+		}
+		djrcv_dev->hidpp_delivered++;
+		return false;
+	}
+
+	/* The driver is the only one waiting for its answers */
+	if (answer) {
+		djrcv_dev->hidpp_suppressed += dj_dev ? 2 : 1;
+		return true;
+	}
+
+	/* data is handed over as is, without any intermediate copy. The
+	 * answered request is forgotten even if the device subscribed */
+	if (dj_dev && (logi_dj_dev_hidpp_requested(dj_dev, data, size) ||
+		       dj_dev->hidpp_subscribed)) {
+		hid_input_report(dj_dev->hdev, HID_INPUT_REPORT, data, size, 1);
+		djrcv_dev->hidpp_delivered++;
+		djrcv_dev->hidpp_suppressed++;
+		return true;
+	}
+
+	if (dj_dev)
+		djrcv_dev->hidpp_suppressed++;
+	djrcv_dev->hidpp_delivered++;
+	return false;
+}
+
+static bool logi_dj_recv_capture_begin(struct dj_receiver_dev *djrcv_dev,
+				       struct dj_capture_record *record,
+				       u8 direction, const u8 *data, int size,
+				       ktime_t timestamp)
+{
+	/* Fills record if capture is on, route is left to the caller */
+	if (likely(!ACCESS_ONCE(djrcv_dev->capture_enabled)) ||
+	    !djrcv_dev->capture_chan)
+		return false;
+
+	memset(record, 0, sizeof(*record));
+	record->timestamp_ns = ktime_to_ns(timestamp);
+	record->direction = direction;
+	record->size = size;
+	memcpy(record->data, data, min_t(int, size, sizeof(record->data)));
+
+	return true;
+}
+
+static void logi_dj_recv_capture_end(struct dj_receiver_dev *djrcv_dev,
+				     struct dj_capture_record *record,
+				     u8 route)
+{
+	/* Lockless, the relay buffers are per cpu */
+	record->route = route;
+	relay_write(djrcv_dev->capture_chan, record, sizeof(*record));
+}
+
+static int logi_dj_recv_submit_output(struct dj_receiver_dev *djrcv_dev,
+				      u8 *data, size_t size)
+{
+	/* Called from logi_dj_recv_output_work() only, which makes it the
+	 * single user of the receiver's output reports */
+	struct hid_device *hdev = djrcv_dev->hdev;
+	struct hid_report *report;
+	struct hid_report_enum *output_report_enum;
+	struct dj_capture_record record;
+	unsigned int i;
+	int retval;
+
+	if (logi_dj_recv_capture_begin(djrcv_dev, &record, DJ_CAPTURE_OUT,
+				       data, size, ktime_get()))
+		logi_dj_recv_capture_end(djrcv_dev, &record,
+					 DJ_CAPTURE_ROUTE_NONE);
+
+	if (djrcv_dev->output_ep) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
+		retval = hid_hw_output_report(hdev, data, size);
+#else
+		/* usbhid uses the interrupt OUT endpoint for output reports */
+		retval = hdev->hid_output_raw_report(hdev, data, size,
+						     HID_OUTPUT_REPORT);
+#endif
+		if (retval == size)
+			return 0;
+
+		dbg_hid("%s: interrupt OUT transfer failed:%d, falling back to "
+			"SET_REPORT\n", __func__, retval);
+		if (retval == -ENOSYS)
+			djrcv_dev->output_ep = false;
+	}
+
+	output_report_enum = &hdev->report_enum[HID_OUTPUT_REPORT];
+	report = output_report_enum->report_id_hash[data[0]];
+
+	if (!report || report->maxfield < 1) {
+		dev_err(&hdev->dev, "%s: unable to find output report %02x\n",
+			__func__, data[0]);
+		return -ENODEV;
+	}
+
+	for (i = 0; i < report->field[0]->report_count && i < size - 1; i++)
+		report->field[0]->value[i] = data[i + 1];
+
+	hid_hw_request(hdev, report, HID_REQ_SET_REPORT);
+
+	return 0;
+}
+
+static unsigned int logi_dj_recv_output_slot(u8 *data)
+{
+	/* DJ and HID++ reports both carry the device index in byte 1 */
+	if ((data[1] < DJ_DEVICE_INDEX_MIN) || (data[1] > DJ_DEVICE_INDEX_MAX))
+		return 0;
+
+	return data[1];
+}
+
+static int logi_dj_recv_queue_output(struct dj_receiver_dev *djrcv_dev,
+				     u8 *data, size_t size)
+{
+	/* May be called from atomic context. Returns -EBUSY when the queue of
+	 * the report's device index is full, other indexes are not affected */
+	struct dj_output_report output;
+	struct kfifo *fifo;
+	unsigned long flags;
+
+	if (size < 2 || size > sizeof(output.data))
+		return -EINVAL;
+
+	memset(&output, 0, sizeof(output));
+	output.size = size;
+	memcpy(output.data, data, size);
+
+	fifo = &djrcv_dev->output_fifo[logi_dj_recv_output_slot(data)];
+
+	spin_lock_irqsave(&djrcv_dev->output_lock, flags);
+	if (kfifo_avail(fifo) < sizeof(output)) {
+		spin_unlock_irqrestore(&djrcv_dev->output_lock, flags);
+		dbg_hid("%s: output queue of index %d full\n", __func__,
+			data[1]);
+		return -EBUSY;
+	}
+	kfifo_in(fifo, &output, sizeof(output));
+	spin_unlock_irqrestore(&djrcv_dev->output_lock, flags);
+
+	if (schedule_work(&djrcv_dev->output_work) == 0) {
+		dbg_hid("%s: did not schedule the work item, was already "
+			"queued\n", __func__);
+	}
+
+	return 0;
+}
+
+static int logi_dj_recv_send_output(struct dj_receiver_dev *djrcv_dev,
+				    u8 *data, size_t size)
+{
+	/* Called in process context: wait for room in the queue and for the
+	 * report to be submitted */
+	int retval;
+
+	for (;;) {
+		retval = logi_dj_recv_queue_output(djrcv_dev, data, size);
+		if (retval != -EBUSY)
+			break;
+
+		if (!wait_event_timeout(djrcv_dev->output_wait,
+				kfifo_avail(&djrcv_dev->output_fifo[
+					logi_dj_recv_output_slot(data)]) >=
+				sizeof(struct dj_output_report),
+				msecs_to_jiffies(DJ_OUTPUT_TIMEOUT_MS)))
+			return -ETIMEDOUT;
+	}
+
+	if (!retval)
+		flush_work(&djrcv_dev->output_work);
+
+	return retval;
+}
+
+static void logi_dj_recv_output_work(struct work_struct *work)
+{
+	struct dj_receiver_dev *djrcv_dev =
+		container_of(work, struct dj_receiver_dev, output_work);
+	struct dj_output_report output;
+	unsigned long flags;
+	unsigned int i, slot;
+	bool powered;
+	int count;
+
+	/* Resume the receiver if needed, it will stay awake for the
+	 * autosuspend delay once we are done, enough to get the answers.
+	 * A failed FULLON holds no reference, there is nothing to drop */
+	powered = !hid_hw_power(djrcv_dev->hdev, PM_HINT_FULLON);
+	if (!powered)
+		dbg_hid("%s: failed resuming the receiver\n", __func__);
+
+	for (;;) {
+		/* Round robin over the device indexes, so that a busy device
+		 * can not starve the others */
+		count = 0;
+		spin_lock_irqsave(&djrcv_dev->output_lock, flags);
+		for (i = 0; i < ARRAY_SIZE(djrcv_dev->output_fifo); i++) {
+			slot = (djrcv_dev->output_next + i) %
+				ARRAY_SIZE(djrcv_dev->output_fifo);
+			count = kfifo_out(&djrcv_dev->output_fifo[slot],
+					  &output, sizeof(output));
+			if (count == sizeof(output)) {
+				djrcv_dev->output_next = slot + 1;
+				break;
+			}
+		}
+		spin_unlock_irqrestore(&djrcv_dev->output_lock, flags);
+
+		if (count != sizeof(output))
+			break;
+
+		wake_up(&djrcv_dev->output_wait);
+
+		logi_dj_recv_submit_output(djrcv_dev, output.data, output.size);
+	}
+
+	if (powered)
+		hid_hw_power(djrcv_dev->hdev, PM_HINT_NORMAL);
+}
+
+static void logi_dj_recv_free_output_fifos(struct dj_receiver_dev *djrcv_dev)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(djrcv_dev->output_fifo); i++)
+		kfifo_free(&djrcv_dev->output_fifo[i]);
+}
+
+static int logi_dj_recv_alloc_output_fifos(struct dj_receiver_dev *djrcv_dev)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(djrcv_dev->output_fifo); i++) {
+		if (kfifo_alloc(&djrcv_dev->output_fifo[i],
+				DJ_MAX_NUMBER_OUTPUTS *
+				sizeof(struct dj_output_report),
+				GFP_KERNEL)) {
+			while (--i >= 0)
+				kfifo_free(&djrcv_dev->output_fifo[i]);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+static void logi_dj_recv_free_hidpp_ring(struct dj_receiver_dev *djrcv_dev)
+{
+	vfree(djrcv_dev->hidpp_ring);
+	djrcv_dev->hidpp_ring = NULL;
+}
+
+static int logi_dj_recv_alloc_hidpp_ring(struct dj_receiver_dev *djrcv_dev)
+{
+	struct dj_hidpp_ring_header *header;
+	u32 nr_frames;
+
+	if (!hidpp_ring_frames)
+		return 0;
+	if (hidpp_ring_frames > DJ_HIDPP_RING_MAX_FRAMES)
+		return -EINVAL;
+
+	nr_frames = roundup_pow_of_two(hidpp_ring_frames);
+	djrcv_dev->hidpp_ring_size = PAGE_ALIGN(PAGE_SIZE + nr_frames *
+					sizeof(struct dj_hidpp_ring_frame));
+
+	header = vmalloc_user(djrcv_dev->hidpp_ring_size);
+	if (!header)
+		return -ENOMEM;
+
+	header->version = DJ_HIDPP_RING_VERSION;
+	header->nr_frames = nr_frames;
+	header->frame_size = sizeof(struct dj_hidpp_ring_frame);
+
+	djrcv_dev->hidpp_ring = header;
+	djrcv_dev->hidpp_ring_frames = (void *)header + PAGE_SIZE;
+	djrcv_dev->hidpp_ring_nr = nr_frames;
+
+	return 0;
+}
+
+static int logi_dj_recv_send_report(struct dj_receiver_dev *djrcv_dev,
+				    struct dj_report *dj_report)
+{
+	/* Called in process context */
+	return logi_dj_recv_send_output(djrcv_dev, (u8 *)dj_report,
+					DJREPORT_SHORT_LENGTH);
+}
+
+static bool logi_dj_recv_hidpp_answer(struct dj_receiver_dev *djrcv_dev,
+				      u8 *data, int size)
+{
+	/* We are called from atomic context (tasklet && djrcv->lock held) */
+	struct dj_hidpp_query *query;
+	bool error;
+	int i;
+
+	if (!djrcv_dev->hidpp_pending || size < HIDPP_REPORT_SHORT_LENGTH)
+		return false;
+
+	error = (data[2] == HIDPP_ERROR) || (data[2] == HIDPP20_ERROR);
+
+	/* Queries are stored in sending order, so an error, which does not
+	 * carry the query parameters, is for the oldest matching query */
+	for (i = 0; i < djrcv_dev->hidpp_nqueries; i++) {
+		query = &djrcv_dev->hidpp_queries[i];
+
+		if (query->status != -ETIMEDOUT ||
+		    query->request[1] != data[1])
+			continue;
+
+		if (error) {
+			if (memcmp(&query->request[2], &data[3], 2))
+				continue;
+			query->status = -EIO;
+		} else {
+			if (memcmp(&query->request[2], &data[2],
+				   query->match_size - 1))
+				continue;
+			query->status = 0;
+		}
+
+		memcpy(query->response, data,
+		       min_t(int, size, sizeof(query->response)));
+		if (--djrcv_dev->hidpp_pending == 0)
+			wake_up(&djrcv_dev->hidpp_wait);
+
+		return true;
+	}
+
+	return false;
+}
+
+static int logi_dj_recv_hidpp_queries(struct dj_receiver_dev *djrcv_dev,
+				      struct dj_hidpp_query *queries, int count)
+{
+	/* Called in process context. All the queries are sent in a row
+	 * before waiting for the answers. Returns the number of answers */
+	unsigned long flags;
+	int i, answered = 0;
+	bool powered;
+
+	mutex_lock(&djrcv_dev->hidpp_mutex);
+
+	/* Keep the receiver awake until the answers are in, the autosuspend
+	 * delay may be shorter than the timeout */
+	powered = !hid_hw_power(djrcv_dev->hdev, PM_HINT_FULLON);
+
+	spin_lock_irqsave(&djrcv_dev->lock, flags);
+	for (i = 0; i < count; i++)
+		queries[i].status = -ETIMEDOUT;
+	djrcv_dev->hidpp_queries = queries;
+	djrcv_dev->hidpp_nqueries = count;
+	djrcv_dev->hidpp_pending = count;
+	spin_unlock_irqrestore(&djrcv_dev->lock, flags);
+
+	for (i = 0; i < count; i++) {
+		if (logi_dj_recv_send_output(djrcv_dev, queries[i].request,
+					     sizeof(queries[i].request)))
+			break;
+	}
+
+	wait_event_timeout(djrcv_dev->hidpp_wait,
+			   djrcv_dev->hidpp_pending == 0,
+			   msecs_to_jiffies(DJ_HIDPP_TIMEOUT_MS));
+
+	spin_lock_irqsave(&djrcv_dev->lock, flags);
+	djrcv_dev->hidpp_queries = NULL;
+	djrcv_dev->hidpp_nqueries = 0;
+	djrcv_dev->hidpp_pending = 0;
+	spin_unlock_irqrestore(&djrcv_dev->lock, flags);
+
+	if (powered)
+		hid_hw_power(djrcv_dev->hdev, PM_HINT_NORMAL);
+
+	mutex_unlock(&djrcv_dev->hidpp_mutex);
+
+	for (i = 0; i < count; i++) {
+		if (!queries[i].status)
+			answered++;
+	}
+
+	return answered;
+}
+
+static int logi_dj_dev_hidpp20_call(struct dj_device *dj_dev, u8 index,
+				    u8 function, const u8 *params, int count,
+				    u8 *response)
+{
+	/* Called in process context. response, if not NULL, receives the
+	 * HIDPP_REPORT_LONG_LENGTH bytes of the answer */
+	struct dj_hidpp_query query;
+
+	if (count > HIDPP_REPORT_SHORT_LENGTH - HIDPP20_PARAMS)
+		return -EINVAL;
+
+	memset(&query, 0, sizeof(query));
+	query.request[0] = REPORT_ID_HIDPP_SHORT;
+	query.request[1] = dj_dev->device_index;
+	query.request[2] = index;
+	query.request[3] = (function << 4) | HIDPP20_SWID;
+	memcpy(&query.request[HIDPP20_PARAMS], params, count);
+	query.match_size = 3;
+
+	logi_dj_recv_hidpp_queries(dj_dev->dj_receiver_dev, &query, 1);
+
+	if (!query.status && response)
+		memcpy(response, query.response, sizeof(query.response));
+
+	return query.status;
+}
+
+static int logi_dj_dev_hidpp20_feature(struct dj_device *dj_dev, u16 feature)
+{
+	/* Called in process context. Returns the index of feature, 0 if the
+	 * device does not support it */
+	u8 params[2];
+	u8 response[HIDPP_REPORT_LONG_LENGTH];
+	int retval;
+
+	put_unaligned_be16(feature, params);
+
+	retval = logi_dj_dev_hidpp20_call(dj_dev, HIDPP20_ROOT_INDEX,
+					  HIDPP20_ROOT_GET_FEATURE, params,
+					  sizeof(params), response);
+	if (retval)
+		return retval;
+
+	return response[HIDPP20_PARAMS];
+}
+
+static void logi_dj_dev_enable_hires(struct dj_device *dj_dev)
+{
+	/* Called in delayed work context */
+	struct dj_receiver_dev *djrcv_dev = dj_dev->dj_receiver_dev;
+	u8 response[HIDPP_REPORT_LONG_LENGTH];
+	u8 mode = HIDPP20_HIRES_WHEEL_MODE_HIRES;
+	u8 multiplier = 0;
+	unsigned long flags;
+	int index;
+
+	index = logi_dj_dev_hidpp20_feature(dj_dev,
+					    HIDPP20_FEATURE_HIRES_WHEEL);
+	if (index <= 0)
+		goto out;
+
+	if (logi_dj_dev_hidpp20_call(dj_dev, index,
+				     HIDPP20_HIRES_WHEEL_GET_CAPABILITY,
+				     NULL, 0, response) ||
+	    !response[HIDPP20_PARAMS])
+		goto out;
+
+	if (logi_dj_dev_hidpp20_call(dj_dev, index,
+				     HIDPP20_HIRES_WHEEL_SET_MODE,
+				     &mode, 1, NULL)) {
+		dev_err(&dj_dev->hdev->dev,
+			"%s: failed enabling high resolution scrolling\n",
+			__func__);
+		goto out;
+	}
+
+	multiplier = response[HIDPP20_PARAMS];
+	dbg_hid("%s: wheel multiplier %d\n", __func__, multiplier);
+
+out:
+	/* The previous multiplier was in use until now */
+	spin_lock_irqsave(&djrcv_dev->lock, flags);
+	if (dj_dev->hires_multiplier != multiplier) {
+		dj_dev->hires_multiplier = multiplier;
+		dj_dev->hires_remainder = 0;
+	}
+	dj_dev->hires_stale = false;
+	spin_unlock_irqrestore(&djrcv_dev->lock, flags);
+}
+
+static void logi_dj_recv_fetch_pairing_info(struct dj_receiver_dev *djrcv_dev)
+{
+	/* Called in delayed work context */
+	struct dj_hidpp_query queries[2 * DJ_MAX_PAIRED_DEVICES];
+	struct dj_pairing_info *info;
+	struct dj_hidpp_query *query;
+	unsigned long flags;
+	int count = 0;
+	int i, len;
+
+	memset(queries, 0, sizeof(queries));
+
+	for (i = DJ_DEVICE_INDEX_MIN; i <= DJ_DEVICE_INDEX_MAX; i++) {
+		if (djrcv_dev->pairing_info[i].valid)
+			continue;
+
+		query = &queries[count++];
+		query->request[0] = REPORT_ID_HIDPP_SHORT;
+		query->request[1] = HIDPP_RECEIVER_INDEX;
+		query->request[2] = HIDPP_GET_LONG_REGISTER;
+		query->request[3] = HIDPP_REG_PAIRING_INFORMATION;
+		query->request[4] = HIDPP_DEVICE_NAME + i - 1;
+		query->match_size = 4;
+
+		query = &queries[count++];
+		*query = queries[count - 2];
+		query->request[4] = HIDPP_EXTENDED_PAIRING + i - 1;
+	}
+
+	if (!count)
+		return;
+
+	logi_dj_recv_hidpp_queries(djrcv_dev, queries, count);
+
+	spin_lock_irqsave(&djrcv_dev->lock, flags);
+	for (i = 0; i < count; i++) {
+		query = &queries[i];
+		if ((query->request[4] & 0x0F) >= DJ_MAX_PAIRED_DEVICES)
+			continue;
+
+		info = &djrcv_dev->pairing_info[(query->request[4] & 0x0F) +
+						DJ_DEVICE_INDEX_MIN];
+		info->valid = true;
+
+		if (query->status)
+			continue;
+
+		if ((query->request[4] & 0xF0) == HIDPP_DEVICE_NAME) {
+			len = min_t(int, query->response[HIDPP_DEVICE_NAME_LENGTH],
+				    HIDPP_DEVICE_NAME_MAX);
+			memcpy(info->name,
+			       &query->response[HIDPP_DEVICE_NAME_STRING], len);
+			info->name[len] = '\0';
+			info->has_name = len > 0;
+		} else {
+			info->serial = get_unaligned_be32(
+				&query->response[HIDPP_EXTENDED_PAIRING_SERIAL]);
+			info->has_serial = true;
+		}
+	}
+	spin_unlock_irqrestore(&djrcv_dev->lock, flags);
+}
+
+static int logi_dj_recv_query_paired_devices(struct dj_receiver_dev *djrcv_dev)
+{
+	struct dj_report *dj_report;
+	int retval;
+
+	unsigned long flags;
+	int i;
+
+	/* no need to protect djrcv_dev->querying_devices */
+	if (djrcv_dev->querying_devices)
+		return 0;
+
+	/* Names and serials are read again along the enumeration */
+	spin_lock_irqsave(&djrcv_dev->lock, flags);
+	for (i = 0; i < ARRAY_SIZE(djrcv_dev->pairing_info); i++)
+		memset(&djrcv_dev->pairing_info[i], 0,
+		       sizeof(djrcv_dev->pairing_info[i]));
+	spin_unlock_irqrestore(&djrcv_dev->lock, flags);
 
 	dj_report = kzalloc(sizeof(struct dj_report), GFP_KERNEL);
 	if (!dj_report)
@@ -574,21 +2657,28 @@ static int logi_dj_recv_query_paired_devices(struct dj_receiver_dev *djrcv_dev)
 	return retval;
 }
 
-
+
+static void logi_dj_recv_init_switch_report(struct dj_report *dj_report,
+					    unsigned timeout)
+{
+	memset(dj_report, 0, sizeof(struct dj_report));
+	dj_report->report_id = REPORT_ID_DJ_SHORT;
+	dj_report->device_index = 0xFF;
+	dj_report->report_type = REPORT_TYPE_CMD_SWITCH;
+	dj_report->report_params[CMD_SWITCH_PARAM_DEVBITFIELD] = 0x3F;
+	dj_report->report_params[CMD_SWITCH_PARAM_TIMEOUT_SECONDS] = (u8)timeout;
+}
+
 static int logi_dj_recv_switch_to_dj_mode(struct dj_receiver_dev *djrcv_dev,
 					  unsigned timeout)
 {
 	struct dj_report *dj_report;
 	int retval;
 
-	dj_report = kzalloc(sizeof(struct dj_report), GFP_KERNEL);
+	dj_report = kmalloc(sizeof(struct dj_report), GFP_KERNEL);
 	if (!dj_report)
 		return -ENOMEM;
-	dj_report->report_id = REPORT_ID_DJ_SHORT;
-	dj_report->device_index = 0xFF;
-	dj_report->report_type = REPORT_TYPE_CMD_SWITCH;
-	dj_report->report_params[CMD_SWITCH_PARAM_DEVBITFIELD] = 0x3F;
-	dj_report->report_params[CMD_SWITCH_PARAM_TIMEOUT_SECONDS] = (u8)timeout;
+	logi_dj_recv_init_switch_report(dj_report, timeout);
 	retval = logi_dj_recv_send_report(djrcv_dev, dj_report);
 	kfree(dj_report);
 
@@ -605,16 +2695,24 @@ static int logi_dj_recv_switch_to_dj_mode(struct dj_receiver_dev *djrcv_dev,
 
 static int logi_dj_ll_open(struct hid_device *hid)
 {
+	struct dj_device *djdev = hid->driver_data;
+
 	dbg_hid("%s:%s\n", __func__, hid->phys);
-	return 0;
 
+	/* Keep the receiver awake while one of its devices is in use */
+	return hid_hw_power(djdev->dj_receiver_dev->hdev, PM_HINT_FULLON);
 }
 
 static void logi_dj_ll_close(struct hid_device *hid)
 {
+	struct dj_device *djdev = hid->driver_data;
+
 	dbg_hid("%s:%s\n", __func__, hid->phys);
+
+	hid_hw_power(djdev->dj_receiver_dev->hdev, PM_HINT_NORMAL);
 }
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 15, 0)
 static int logi_dj_output_hidraw_report(struct hid_device *hid, u8 * buf,
 					size_t count,
 					unsigned char report_type)
@@ -624,12 +2722,53 @@ static int logi_dj_output_hidraw_report(struct hid_device *hid, u8 * buf,
 
 	return 0;
 }
+#else
+static int logi_dj_ll_raw_request(struct hid_device *hid,
+				  unsigned char reportnum, __u8 *buf,
+				  size_t count, unsigned char report_type,
+				  int reqtype)
+{
+	/* Called by hid raw to send data, only HID++ requests are forwarded
+	 * to the receiver, with the device index of hid */
+	struct dj_device *djdev = hid->driver_data;
+	struct dj_receiver_dev *djrcv_dev = djdev->dj_receiver_dev;
+	u8 data[HIDPP_REPORT_LONG_LENGTH];
+	unsigned long flags;
+	int retval;
+
+	dbg_hid("%s\n", __func__);
+
+	/* The aggregate devices have no index of their own */
+	if (logi_dj_dev_is_aggregate(djdev))
+		return -EINVAL;
+
+	if ((reqtype != HID_REQ_SET_REPORT) || (count < 2) ||
+	    (count > sizeof(data)) ||
+	    ((buf[0] != REPORT_ID_HIDPP_SHORT) &&
+	     (buf[0] != REPORT_ID_HIDPP_LONG)))
+		return -EINVAL;
+
+	memcpy(data, buf, count);
+	data[1] = djdev->device_index;
+
+	if (hidpp_routing) {
+		spin_lock_irqsave(&djrcv_dev->lock, flags);
+		logi_dj_dev_hidpp_request(djdev, data);
+		spin_unlock_irqrestore(&djrcv_dev->lock, flags);
+	}
+
+	retval = logi_dj_recv_send_output(djrcv_dev, data, count);
+
+	return retval ? retval : count;
+}
+#endif
 
 static void logi_dj_ll_request(struct hid_device *hid, struct hid_report *rep,
 		int reqtype)
 {
 	struct dj_device *djdev = hid->driver_data;
 	struct dj_receiver_dev *djrcv_dev = djdev->dj_receiver_dev;
+	int retval;
 
 	if ((rep->id != REPORT_ID_HIDPP_LONG) &&
 	    (rep->id != REPORT_ID_HIDPP_SHORT))
@@ -638,6 +2777,36 @@ static void logi_dj_ll_request(struct hid_device *hid, struct hid_report *rep,
 
 	hid_set_field(rep->field[0], 0, djdev->device_index);
 
+	if (reqtype == HID_REQ_SET_REPORT) {
+		u8 data[HIDPP_REPORT_LONG_LENGTH];
+		size_t size = ((rep->size - 1) >> 3) + 1 + (rep->id > 0);
+
+		if (size > sizeof(data))
+			return;
+
+		hid_output_report(rep, data);
+
+		if (hidpp_routing) {
+			unsigned long flags;
+
+			spin_lock_irqsave(&djrcv_dev->lock, flags);
+			logi_dj_dev_hidpp_request(djdev, data);
+			spin_unlock_irqrestore(&djrcv_dev->lock, flags);
+		}
+
+		/* Callers may be atomic, only wait for room in the queue
+		 * when sleeping is allowed */
+		if (preemptible())
+			retval = logi_dj_recv_send_output(djrcv_dev, data, size);
+		else
+			retval = logi_dj_recv_queue_output(djrcv_dev, data, size);
+		if (retval)
+			dev_warn_ratelimited(&hid->dev,
+				"%s: report of index %d dropped: %d\n",
+				__func__, djdev->device_index, retval);
+		return;
+	}
+
 	hid_hw_request(djrcv_dev->hdev, rep, reqtype);
 }
 
@@ -663,13 +2832,13 @@ static int logi_dj_ll_parse(struct hid_device *hid)
 	if (!rdesc)
 		return -ENOMEM;
 
-	if (djdev->reports_supported & STD_KEYBOARD) {
+	if ((djdev->reports_supported & STD_KEYBOARD) && !djdev->kbd_input) {
 		dbg_hid("%s: sending a kbd descriptor, reports_supported: %x\n",
 			__func__, djdev->reports_supported);
 		rdcat(rdesc, &rsize, kbd_descriptor, sizeof(kbd_descriptor));
 	}
 
-	if (djdev->reports_supported & STD_MOUSE) {
+	if ((djdev->reports_supported & STD_MOUSE) && !djdev->mouse_input) {
 		dbg_hid("%s: sending a mouse descriptor, reports_supported: "
 			"%x\n", __func__, djdev->reports_supported);
 		rdcat(rdesc, &rsize, mse_descriptor, sizeof(mse_descriptor));
@@ -698,88 +2867,600 @@ static int logi_dj_ll_parse(struct hid_device *hid)
 			__func__, djdev->reports_supported);
 	}
 
-	rdcat(rdesc, &rsize, hidpp_descriptor, sizeof(hidpp_descriptor));
+	/* HID++ reports need a device index, which the aggregate devices
+	 * do not have */
+	if (!logi_dj_dev_is_aggregate(djdev))
+		rdcat(rdesc, &rsize, hidpp_descriptor,
+		      sizeof(hidpp_descriptor));
+
+	retval = hid_parse_report(hid, rdesc, rsize);
+	kfree(rdesc);
+
+	return retval;
+}
+
+static int logi_dj_ll_input_event(struct input_dev *dev, unsigned int type,
+				  unsigned int code, int value)
+{
+	/* Sent by the input layer to handle leds and Force Feedback */
+	struct hid_device *dj_hiddev = input_get_drvdata(dev);
+	struct dj_device *dj_dev = dj_hiddev->driver_data;
+
+
+	struct hid_field *field;
+	unsigned char *data;
+	u8 leds;
+	int offset;
+
+	dbg_hid("%s: %s, type:%d | code:%d | value:%d\n",
+		__func__, dev->phys, type, code, value);
+
+	if (type != EV_LED)
+		return -1;
+
+	offset = hidinput_find_field(dj_hiddev, type, code, &field);
+
+	if (offset == -1) {
+		dev_warn(&dev->dev, "event field not found\n");
+		return -1;
+	}
+	hid_set_field(field, offset, value);
+
+	data = hid_alloc_report_buf(field->report, GFP_ATOMIC);
+	if (!data) {
+		dev_warn(&dev->dev, "failed to allocate report buf memory\n");
+		return -1;
+	}
+
+	hid_output_report(field->report, &data[0]);
+	leds = data[1];
+	kfree(data);
+
+	return logi_dj_dev_set_leds(dj_dev, leds) ? -1 : 0;
+}
+
+static int logi_dj_ll_start(struct hid_device *hid)
+{
+	dbg_hid("%s\n", __func__);
+	return 0;
+}
+
+static void logi_dj_ll_stop(struct hid_device *hid)
+{
+	dbg_hid("%s\n", __func__);
+}
+
+
+static struct hid_ll_driver logi_dj_ll_driver = {
+	.parse = logi_dj_ll_parse,
+	.start = logi_dj_ll_start,
+	.stop = logi_dj_ll_stop,
+	.open = logi_dj_ll_open,
+	.close = logi_dj_ll_close,
+	.request = logi_dj_ll_request,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
+	.raw_request = logi_dj_ll_raw_request,
+#endif
+	.hidinput_input_event = logi_dj_ll_input_event,
+};
+
+
+static ssize_t logi_dj_wake_latency_show(struct device *dev,
+					 struct device_attribute *attr,
+					 char *buf)
+{
+	/* Time between the last resume and the first report, in us */
+	struct dj_receiver_dev *djrcv_dev = dev_get_drvdata(dev);
+	unsigned long flags;
+	ktime_t wake_latency;
+
+	spin_lock_irqsave(&djrcv_dev->lock, flags);
+	wake_latency = djrcv_dev->wake_latency;
+	spin_unlock_irqrestore(&djrcv_dev->lock, flags);
+
+	return scnprintf(buf, PAGE_SIZE, "%lld\n", ktime_to_us(wake_latency));
+}
+
+static DEVICE_ATTR(wake_latency_us, S_IRUGO, logi_dj_wake_latency_show, NULL);
+
+static ssize_t logi_dj_hidpp_delivered_show(struct device *dev,
+					    struct device_attribute *attr,
+					    char *buf)
+{
+	struct dj_receiver_dev *djrcv_dev = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%lu\n", djrcv_dev->hidpp_delivered);
+}
+
+static DEVICE_ATTR(hidpp_delivered, S_IRUGO, logi_dj_hidpp_delivered_show,
+		   NULL);
+
+static ssize_t logi_dj_hidpp_suppressed_show(struct device *dev,
+					     struct device_attribute *attr,
+					     char *buf)
+{
+	struct dj_receiver_dev *djrcv_dev = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%lu\n", djrcv_dev->hidpp_suppressed);
+}
+
+static DEVICE_ATTR(hidpp_suppressed, S_IRUGO, logi_dj_hidpp_suppressed_show,
+		   NULL);
+
+static ssize_t logi_dj_poll_interval_show(struct device *dev,
+					  struct device_attribute *attr,
+					  char *buf)
+{
+	/* Polling interval of the IN endpoint, in the transport's units */
+	struct dj_receiver_dev *djrcv_dev = dev_get_drvdata(dev);
+	int interval;
+
+	if (!djrcv_dev->transport->poll_interval)
+		return -ENODEV;
+
+	interval = djrcv_dev->transport->poll_interval(djrcv_dev);
+	if (interval < 0)
+		return interval;
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n", interval);
+}
+
+static DEVICE_ATTR(poll_interval, S_IRUGO, logi_dj_poll_interval_show, NULL);
+
+static ssize_t logi_dj_aggregate_slots_show(struct device *dev,
+					    struct device_attribute *attr,
+					    char *buf)
+{
+	/* One line per aggregated device: index, wireless PID, supported
+	 * reports and name */
+	struct dj_receiver_dev *djrcv_dev = dev_get_drvdata(dev);
+	struct dj_device *dj_dev;
+	unsigned long flags;
+	ssize_t len = 0;
+	int i;
+
+	spin_lock_irqsave(&djrcv_dev->lock, flags);
+	for (i = DJ_DEVICE_INDEX_MIN; i <= DJ_DEVICE_INDEX_MAX; i++) {
+		dj_dev = djrcv_dev->paired_dj_devices[i];
+		if (!dj_dev || !dj_dev->aggregated)
+			continue;
+
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				 "%d %04x %08x %s\n", i, dj_dev->wpid,
+				 dj_dev->reports_supported, dj_dev->name);
+	}
+	spin_unlock_irqrestore(&djrcv_dev->lock, flags);
+
+	return len;
+}
+
+static DEVICE_ATTR(aggregate_slots, S_IRUGO, logi_dj_aggregate_slots_show,
+		   NULL);
+
+static struct attribute *logi_dj_receiver_attrs[] = {
+	&dev_attr_wake_latency_us.attr,
+	&dev_attr_hidpp_delivered.attr,
+	&dev_attr_hidpp_suppressed.attr,
+	&dev_attr_poll_interval.attr,
+	&dev_attr_aggregate_slots.attr,
+	NULL
+};
+
+static const struct attribute_group logi_dj_receiver_attr_group = {
+	.attrs = logi_dj_receiver_attrs,
+};
+
+static void logi_dj_recv_release(struct kref *kref)
+{
+	struct dj_receiver_dev *djrcv_dev =
+		container_of(kref, struct dj_receiver_dev, kref);
+
+	logi_dj_recv_free_hidpp_ring(djrcv_dev);
+	kfree(djrcv_dev);
+}
+
+static void logi_dj_recv_put(struct dj_receiver_dev *djrcv_dev)
+{
+	kref_put(&djrcv_dev->kref, logi_dj_recv_release);
+}
+
+static struct dj_receiver_dev *logi_dj_debugfs_get(struct inode *inode)
+{
+	/* Returns a reference on the receiver of a debugfs file, NULL once
+	 * the file is revoked */
+	struct dj_receiver_dev *djrcv_dev;
+
+	mutex_lock(&logi_dj_debugfs_mutex);
+	djrcv_dev = inode->i_private;
+	if (djrcv_dev)
+		kref_get(&djrcv_dev->kref);
+	mutex_unlock(&logi_dj_debugfs_mutex);
+
+	return djrcv_dev;
+}
+
+static int logi_dj_debugfs_single_open(struct inode *inode, struct file *file,
+				       int (*show)(struct seq_file *, void *))
+{
+	struct dj_receiver_dev *djrcv_dev = logi_dj_debugfs_get(inode);
+	int retval;
+
+	if (!djrcv_dev)
+		return -ENODEV;
+
+	retval = single_open(file, show, djrcv_dev);
+	if (retval)
+		logi_dj_recv_put(djrcv_dev);
+
+	return retval;
+}
+
+static int logi_dj_debugfs_single_release(struct inode *inode,
+					  struct file *file)
+{
+	struct seq_file *s = file->private_data;
+	struct dj_receiver_dev *djrcv_dev = s->private;
+	int retval;
+
+	retval = single_release(inode, file);
+	logi_dj_recv_put(djrcv_dev);
+
+	return retval;
+}
+
+static int logi_dj_hidpp_ring_open(struct inode *inode, struct file *file)
+{
+	struct dj_receiver_dev *djrcv_dev = logi_dj_debugfs_get(inode);
+	struct dj_hidpp_ring_header *header;
+	unsigned long flags;
+	int retval = 0;
+
+	if (!djrcv_dev)
+		return -ENODEV;
+
+	header = djrcv_dev->hidpp_ring;
+
+	spin_lock_irqsave(&djrcv_dev->lock, flags);
+	if (djrcv_dev->hidpp_ring_open) {
+		retval = -EBUSY;
+	} else {
+		djrcv_dev->hidpp_ring_head = 0;
+		header->head = 0;
+		header->tail = 0;
+		header->overflows = 0;
+		djrcv_dev->hidpp_ring_open = true;
+	}
+	spin_unlock_irqrestore(&djrcv_dev->lock, flags);
+
+	if (retval) {
+		logi_dj_recv_put(djrcv_dev);
+		return retval;
+	}
+
+	file->private_data = djrcv_dev;
+
+	return 0;
+}
+
+static int logi_dj_hidpp_ring_release(struct inode *inode, struct file *file)
+{
+	struct dj_receiver_dev *djrcv_dev = file->private_data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&djrcv_dev->lock, flags);
+	djrcv_dev->hidpp_ring_open = false;
+	spin_unlock_irqrestore(&djrcv_dev->lock, flags);
+
+	logi_dj_recv_put(djrcv_dev);
+
+	return 0;
+}
+
+static int logi_dj_hidpp_ring_mmap(struct file *file,
+				   struct vm_area_struct *vma)
+{
+	struct dj_receiver_dev *djrcv_dev = file->private_data;
+
+	if (vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start > djrcv_dev->hidpp_ring_size)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, djrcv_dev->hidpp_ring, 0);
+}
+
+static unsigned int logi_dj_hidpp_ring_poll(struct file *file,
+					    poll_table *wait)
+{
+	struct dj_receiver_dev *djrcv_dev = file->private_data;
+
+	poll_wait(file, &djrcv_dev->hidpp_ring_wait, wait);
+
+	if (ACCESS_ONCE(djrcv_dev->hidpp_ring->tail) !=
+	    ACCESS_ONCE(djrcv_dev->hidpp_ring_head))
+		return POLLIN | POLLRDNORM;
+
+	return 0;
+}
+
+static const struct file_operations logi_dj_hidpp_ring_fops = {
+	.owner = THIS_MODULE,
+	.open = logi_dj_hidpp_ring_open,
+	.release = logi_dj_hidpp_ring_release,
+	.mmap = logi_dj_hidpp_ring_mmap,
+	.poll = logi_dj_hidpp_ring_poll,
+};
+
+static int logi_dj_intervals_show(struct seq_file *s, void *unused)
+{
+	/* Non empty buckets of each device index, the counters may be
+	 * updated meanwhile */
+	struct dj_receiver_dev *djrcv_dev = s->private;
+	struct dj_interval_histogram *hist;
+	int i, n;
+
+	for (i = DJ_DEVICE_INDEX_MIN; i <= DJ_DEVICE_INDEX_MAX; i++) {
+		hist = &djrcv_dev->intervals[i];
+		if (!hist->last_ns)
+			continue;
+
+		seq_printf(s, "device %d:\n", i);
+		for (n = 0; n < DJ_INTERVAL_BUCKETS; n++) {
+			if (!hist->buckets[n])
+				continue;
+			seq_printf(s, "  %llu-%llu ns: %u\n",
+				   n ? 1ULL << (n - 1) : 0ULL,
+				   (1ULL << n) - 1, hist->buckets[n]);
+		}
+	}
+
+	return 0;
+}
+
+static int logi_dj_intervals_open(struct inode *inode, struct file *file)
+{
+	return logi_dj_debugfs_single_open(inode, file,
+					   logi_dj_intervals_show);
+}
+
+static ssize_t logi_dj_intervals_write(struct file *file,
+				       const char __user *buf, size_t count,
+				       loff_t *ppos)
+{
+	/* Any write resets the histograms */
+	struct seq_file *s = file->private_data;
+	struct dj_receiver_dev *djrcv_dev = s->private;
+	unsigned long flags;
+
+	spin_lock_irqsave(&djrcv_dev->lock, flags);
+	memset(djrcv_dev->intervals, 0, sizeof(djrcv_dev->intervals));
+	spin_unlock_irqrestore(&djrcv_dev->lock, flags);
+
+	return count;
+}
+
+static const struct file_operations logi_dj_intervals_fops = {
+	.owner = THIS_MODULE,
+	.open = logi_dj_intervals_open,
+	.read = seq_read,
+	.write = logi_dj_intervals_write,
+	.llseek = seq_lseek,
+	.release = logi_dj_debugfs_single_release,
+};
+
+static int logi_dj_capture_enable_open(struct inode *inode, struct file *file)
+{
+	struct dj_receiver_dev *djrcv_dev = logi_dj_debugfs_get(inode);
+
+	if (!djrcv_dev)
+		return -ENODEV;
+
+	file->private_data = djrcv_dev;
+
+	return nonseekable_open(inode, file);
+}
+
+static ssize_t logi_dj_capture_enable_read(struct file *file,
+					   char __user *buf, size_t count,
+					   loff_t *ppos)
+{
+	struct dj_receiver_dev *djrcv_dev = file->private_data;
+	char tmp[12];
+	int len;
 
-	retval = hid_parse_report(hid, rdesc, rsize);
-	kfree(rdesc);
+	len = scnprintf(tmp, sizeof(tmp), "%u\n",
+			ACCESS_ONCE(djrcv_dev->capture_enabled));
 
-	return retval;
+	return simple_read_from_buffer(buf, count, ppos, tmp, len);
 }
 
-static int logi_dj_ll_input_event(struct input_dev *dev, unsigned int type,
-				  unsigned int code, int value)
+static ssize_t logi_dj_capture_enable_write(struct file *file,
+					    const char __user *buf,
+					    size_t count, loff_t *ppos)
 {
-	/* Sent by the input layer to handle leds and Force Feedback */
-	struct hid_device *dj_hiddev = input_get_drvdata(dev);
-	struct dj_device *dj_dev = dj_hiddev->driver_data;
+	struct dj_receiver_dev *djrcv_dev = file->private_data;
+	u32 enabled;
+	int retval;
 
-	struct dj_receiver_dev *djrcv_dev =
-	    dev_get_drvdata(dj_hiddev->dev.parent);
-	struct hid_device *dj_rcv_hiddev = djrcv_dev->hdev;
-	struct hid_report_enum *output_report_enum;
+	retval = kstrtou32_from_user(buf, count, 0, &enabled);
+	if (retval)
+		return retval;
 
-	struct hid_field *field;
-	struct hid_report *report;
-	unsigned char *data;
-	int offset;
+	djrcv_dev->capture_enabled = enabled;
 
-	dbg_hid("%s: %s, type:%d | code:%d | value:%d\n",
-		__func__, dev->phys, type, code, value);
+	return count;
+}
 
-	if (type != EV_LED)
-		return -1;
+static int logi_dj_capture_enable_release(struct inode *inode,
+					  struct file *file)
+{
+	logi_dj_recv_put(file->private_data);
 
-	offset = hidinput_find_field(dj_hiddev, type, code, &field);
+	return 0;
+}
 
-	if (offset == -1) {
-		dev_warn(&dev->dev, "event field not found\n");
-		return -1;
+static const struct file_operations logi_dj_capture_enable_fops = {
+	.owner = THIS_MODULE,
+	.open = logi_dj_capture_enable_open,
+	.read = logi_dj_capture_enable_read,
+	.write = logi_dj_capture_enable_write,
+	.llseek = no_llseek,
+	.release = logi_dj_capture_enable_release,
+};
+
+static int logi_dj_timing_show(struct seq_file *s, void *unused)
+{
+	/* Probe phases from the start of the probe, paired device phases
+	 * from the scheduling of their work, in us */
+	struct dj_receiver_dev *djrcv_dev = s->private;
+	ktime_t *timing;
+	int i, phase;
+
+	seq_puts(s, "probe:\n");
+	timing = djrcv_dev->probe_timing;
+	for (phase = DJ_PROBE_START + 1; phase < DJ_PROBE_PHASES; phase++) {
+		if (!ktime_to_ns(timing[phase]))
+			continue;
+		seq_printf(s, "  %s: +%lld us\n", dj_probe_phase_names[phase],
+			   ktime_to_us(ktime_sub(timing[phase],
+						 timing[DJ_PROBE_START])));
 	}
-	hid_set_field(field, offset, value);
 
-	data = hid_alloc_report_buf(field->report, GFP_ATOMIC);
-	if (!data) {
-		dev_warn(&dev->dev, "failed to allocate report buf memory\n");
-		return -1;
+	for (i = DJ_DEVICE_INDEX_MIN; i <= DJ_DEVICE_INDEX_MAX; i++) {
+		timing = djrcv_dev->add_timing[i];
+		if (!ktime_to_ns(timing[DJ_ADD_QUEUED]))
+			continue;
+
+		seq_printf(s, "device %d: queued +%lld us after probe start\n",
+			   i, ktime_to_us(ktime_sub(timing[DJ_ADD_QUEUED],
+				djrcv_dev->probe_timing[DJ_PROBE_START])));
+		for (phase = DJ_ADD_QUEUED + 1; phase < DJ_ADD_PHASES;
+		     phase++) {
+			if (!ktime_to_ns(timing[phase]))
+				continue;
+			seq_printf(s, "  %s: +%lld us\n",
+				   dj_add_phase_names[phase],
+				   ktime_to_us(ktime_sub(timing[phase],
+						timing[DJ_ADD_QUEUED])));
+		}
 	}
 
-	hid_output_report(field->report, &data[0]);
+	return 0;
+}
 
-	output_report_enum = &dj_rcv_hiddev->report_enum[HID_OUTPUT_REPORT];
-	report = output_report_enum->report_id_hash[REPORT_ID_DJ_SHORT];
-	hid_set_field(report->field[0], 0, dj_dev->device_index);
-	hid_set_field(report->field[0], 1, REPORT_TYPE_LEDS);
-	hid_set_field(report->field[0], 2, data[1]);
+static int logi_dj_timing_open(struct inode *inode, struct file *file)
+{
+	return logi_dj_debugfs_single_open(inode, file, logi_dj_timing_show);
+}
 
-	hid_hw_request(dj_rcv_hiddev, report, HID_REQ_SET_REPORT);
+static const struct file_operations logi_dj_timing_fops = {
+	.owner = THIS_MODULE,
+	.open = logi_dj_timing_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = logi_dj_debugfs_single_release,
+};
 
-	kfree(data);
+static struct dentry *logi_dj_capture_create_buf_file(const char *filename,
+						      struct dentry *parent,
+						      umode_t mode,
+						      struct rchan_buf *buf,
+						      int *is_global)
+{
+	return debugfs_create_file(filename, mode, parent, buf,
+				   &relay_file_operations);
+}
+
+static int logi_dj_capture_remove_buf_file(struct dentry *dentry)
+{
+	debugfs_remove(dentry);
 
 	return 0;
 }
 
-static int logi_dj_ll_start(struct hid_device *hid)
+static int logi_dj_capture_subbuf_start(struct rchan_buf *buf, void *subbuf,
+					void *prev_subbuf, size_t prev_padding)
 {
-	dbg_hid("%s\n", __func__);
-	return 0;
+	/* Flight recorder: overwrite the oldest sub-buffer when full */
+	return 1;
 }
 
-static void logi_dj_ll_stop(struct hid_device *hid)
+static struct rchan_callbacks logi_dj_capture_callbacks = {
+	.subbuf_start = logi_dj_capture_subbuf_start,
+	.create_buf_file = logi_dj_capture_create_buf_file,
+	.remove_buf_file = logi_dj_capture_remove_buf_file,
+};
+
+static void logi_dj_recv_debugfs_file(struct dj_receiver_dev *djrcv_dev,
+				      const char *name, umode_t mode,
+				      const struct file_operations *fops)
 {
-	dbg_hid("%s\n", __func__);
+	/* The files get djrcv_dev through logi_dj_debugfs_get() */
+	struct dentry *dentry;
+
+	dentry = debugfs_create_file(name, mode, djrcv_dev->debugfs_dir,
+				     djrcv_dev, fops);
+	if (IS_ERR_OR_NULL(dentry))
+		return;
+
+	djrcv_dev->debugfs_files[djrcv_dev->debugfs_nfiles++] = dentry;
 }
 
+static void logi_dj_recv_create_debugfs(struct dj_receiver_dev *djrcv_dev)
+{
+	/* debugfs is optional, failures are ignored */
+	if (!logi_dj_debugfs_root)
+		return;
 
-static struct hid_ll_driver logi_dj_ll_driver = {
-	.parse = logi_dj_ll_parse,
-	.start = logi_dj_ll_start,
-	.stop = logi_dj_ll_stop,
-	.open = logi_dj_ll_open,
-	.close = logi_dj_ll_close,
-	.request = logi_dj_ll_request,
-	.hidinput_input_event = logi_dj_ll_input_event,
-};
+	djrcv_dev->debugfs_dir = debugfs_create_dir(
+			dev_name(&djrcv_dev->hdev->dev), logi_dj_debugfs_root);
+	if (!djrcv_dev->debugfs_dir)
+		return;
+
+	logi_dj_recv_debugfs_file(djrcv_dev, "timing", S_IRUSR,
+				  &logi_dj_timing_fops);
+
+	logi_dj_recv_debugfs_file(djrcv_dev, "report_intervals",
+				  S_IRUSR | S_IWUSR, &logi_dj_intervals_fops);
+
+	/* Writable: the reader advances tail through a shared mapping */
+	if (djrcv_dev->hidpp_ring)
+		logi_dj_recv_debugfs_file(djrcv_dev, "hidpp_ring",
+					  S_IRUSR | S_IWUSR,
+					  &logi_dj_hidpp_ring_fops);
+
+	if (capture_kb) {
+		djrcv_dev->capture_chan = relay_open("capture",
+					djrcv_dev->debugfs_dir,
+					capture_kb * 1024 / 4, 4,
+					&logi_dj_capture_callbacks, djrcv_dev);
+		if (djrcv_dev->capture_chan)
+			logi_dj_recv_debugfs_file(djrcv_dev, "capture_enable",
+					S_IRUSR | S_IWUSR,
+					&logi_dj_capture_enable_fops);
+	}
+}
+
+static void logi_dj_recv_remove_debugfs(struct dj_receiver_dev *djrcv_dev)
+{
+	int i;
+
+	/* The relay files live in debugfs_dir, close the channel first */
+	if (djrcv_dev->capture_chan) {
+		relay_close(djrcv_dev->capture_chan);
+		djrcv_dev->capture_chan = NULL;
+	}
+
+	/* debugfs does not wait for the open files: revoke the files, the
+	 * open ones keep their reference on djrcv_dev */
+	mutex_lock(&logi_dj_debugfs_mutex);
+	for (i = 0; i < djrcv_dev->debugfs_nfiles; i++)
+		djrcv_dev->debugfs_files[i]->d_inode->i_private = NULL;
+	debugfs_remove_recursive(djrcv_dev->debugfs_dir);
+	mutex_unlock(&logi_dj_debugfs_mutex);
 
+	djrcv_dev->debugfs_nfiles = 0;
+	djrcv_dev->debugfs_dir = NULL;
+}
 
 static int logi_dj_raw_event(struct hid_device *hdev,
 			     struct hid_report *report, u8 *data,
@@ -789,6 +3470,12 @@ static int logi_dj_raw_event(struct hid_device *hdev,
 	struct dj_report *dj_report = (struct dj_report *) data;
 	unsigned long flags;
 	bool report_processed = false;
+	bool answer;
+	struct dj_capture_record record;
+	bool capture;
+	u8 route = DJ_CAPTURE_ROUTE_RECEIVER;
+	/* Earliest point where we see the report */
+	ktime_t timestamp = ktime_get();
 
 	dbg_hid("%s, size:%d\n", __func__, size);
 
@@ -819,46 +3506,76 @@ static int logi_dj_raw_event(struct hid_device *hdev,
 	 * data to the corresponding child dj device and return 0 to hid-core
 	 * so he data also goes to the hidraw device of the receiver. This
 	 * allows a user space application to implement the full HID++ routing
-	 * via the receiver.
+	 * via the receiver. With hidpp_routing, the data goes either to the
+	 * child, if it asked for it, or to the receiver hidraw, and answers
+	 * to the driver's own queries go nowhere else.
 	 */
 
+	/* Capture the report before it gets rewritten */
+	capture = logi_dj_recv_capture_begin(djrcv_dev, &record,
+					     DJ_CAPTURE_IN, data, size,
+					     timestamp);
+
 	spin_lock_irqsave(&djrcv_dev->lock, flags);
+
+	if (unlikely(ktime_to_ns(djrcv_dev->resume_time))) {
+		djrcv_dev->wake_latency = ktime_sub(timestamp,
+						    djrcv_dev->resume_time);
+		djrcv_dev->resume_time = ktime_set(0, 0);
+	}
+
 	switch (data[0]) {
 	case REPORT_ID_DJ_SHORT:
 		switch (dj_report->report_type) {
 		case REPORT_TYPE_NOTIF_DEVICE_PAIRED:
 		case REPORT_TYPE_NOTIF_DEVICE_UNPAIRED:
 			logi_dj_recv_queue_notification(djrcv_dev, dj_report);
+			route = DJ_CAPTURE_ROUTE_DRIVER;
 			break;
 		case REPORT_TYPE_NOTIF_CONNECTION_STATUS:
+			logi_dj_recv_update_link_state(djrcv_dev, dj_report,
+						       timestamp);
 			if (dj_report->report_params[CONNECTION_STATUS_PARAM_STATUS] ==
 			    STATUS_LINKLOSS) {
 				logi_dj_recv_forward_null_report(djrcv_dev, dj_report);
 			}
+			route = DJ_CAPTURE_ROUTE_DRIVER;
 			break;
 		default:
-			logi_dj_recv_forward_report(djrcv_dev, dj_report);
+			if (logi_dj_recv_filter_report(djrcv_dev, dj_report)) {
+				logi_dj_recv_forward_report(djrcv_dev,
+							    dj_report,
+							    timestamp);
+				route = DJ_CAPTURE_ROUTE_DEVICE;
+			} else {
+				route = DJ_CAPTURE_ROUTE_DROPPED;
+			}
 		}
 		report_processed = true;
 		break;
 	case REPORT_ID_HIDPP_SHORT:
 		/* intentional fallthrough */
 	case REPORT_ID_HIDPP_LONG:
-		logi_dj_recv_forward_hidpp(djrcv_dev, data, size);
-		report_processed = false;
+		answer = logi_dj_recv_hidpp_answer(djrcv_dev, data, size);
+		report_processed = logi_dj_recv_forward_hidpp(djrcv_dev, data,
+							      size, answer,
+							      timestamp);
+		if (report_processed)
+			route = answer ? DJ_CAPTURE_ROUTE_DRIVER :
+					 DJ_CAPTURE_ROUTE_DEVICE;
 		break;
 	}
 	spin_unlock_irqrestore(&djrcv_dev->lock, flags);
 
+	if (unlikely(capture))
+		logi_dj_recv_capture_end(djrcv_dev, &record, route);
+
 	return report_processed;
 }
 
-static int logi_dj_probe(struct hid_device *hdev,
-			 const struct hid_device_id *id)
+static bool logi_dj_usb_is_dj_interface(struct hid_device *hdev)
 {
 	struct usb_interface *intf = to_usb_interface(hdev->dev.parent);
-	struct dj_receiver_dev *djrcv_dev;
-	int retval;
 
 	dbg_hid("%s called for ifnum %d\n", __func__,
 		intf->cur_altsetting->desc.bInterfaceNumber);
@@ -869,9 +3586,232 @@ static int logi_dj_probe(struct hid_device *hdev,
 	    LOGITECH_DJ_INTERFACE_NUMBER) {
 		dbg_hid("%s: ignoring ifnum %d\n", __func__,
 			intf->cur_altsetting->desc.bInterfaceNumber);
-		return -ENODEV;
+		return false;
+	}
+
+	return true;
+}
+
+static void logi_dj_usb_make_path(struct hid_device *hdev, char *buf,
+				  size_t size)
+{
+	struct usb_interface *intf = to_usb_interface(hdev->dev.parent);
+
+	usb_make_path(interface_to_usbdev(intf), buf, size);
+}
+
+static bool logi_dj_usb_has_output_ep(struct hid_device *hdev)
+{
+	struct usb_interface *intf = to_usb_interface(hdev->dev.parent);
+	struct usb_host_interface *interface = intf->cur_altsetting;
+	int i;
+
+	for (i = 0; i < interface->desc.bNumEndpoints; i++) {
+		if (usb_endpoint_is_int_out(&interface->endpoint[i].desc))
+			return true;
+	}
+
+	return false;
+}
+
+static struct usb_endpoint_descriptor *logi_dj_usb_in_ep(struct hid_device *hdev)
+{
+	struct usb_interface *intf = to_usb_interface(hdev->dev.parent);
+	struct usb_host_interface *interface = intf->cur_altsetting;
+	int i;
+
+	for (i = 0; i < interface->desc.bNumEndpoints; i++) {
+		if (usb_endpoint_is_int_in(&interface->endpoint[i].desc))
+			return &interface->endpoint[i].desc;
+	}
+
+	return NULL;
+}
+
+static unsigned int logi_dj_usb_requested_interval(struct usb_device *usbdev)
+{
+	/* Returns the interval asked for usbdev in poll_intervals, 0 if none */
+	const char *name = dev_name(&usbdev->dev);
+	size_t len = strlen(name);
+	const char *p = poll_intervals;
+	unsigned int interval;
+
+	while (p && *p) {
+		if (!strncmp(p, name, len) && p[len] == '=' &&
+		    sscanf(p + len + 1, "%u", &interval) == 1)
+			return clamp_t(unsigned int, interval, 1, 255);
+
+		p = strchr(p, ',');
+		if (p)
+			p++;
 	}
 
+	return 0;
+}
+
+static void logi_dj_usb_start(struct dj_receiver_dev *djrcv_dev)
+{
+	/* Called before hid_hw_start(), which submits the IN urb with the
+	 * endpoint's bInterval */
+	struct hid_device *hdev = djrcv_dev->hdev;
+	struct usb_interface *intf = to_usb_interface(hdev->dev.parent);
+	struct usb_endpoint_descriptor *endpoint;
+	unsigned int interval;
+
+	interval = logi_dj_usb_requested_interval(interface_to_usbdev(intf));
+	if (!interval)
+		return;
+
+	endpoint = logi_dj_usb_in_ep(hdev);
+	if (!endpoint)
+		return;
+
+	dbg_hid("%s: polling interval %d -> %d\n", __func__,
+		endpoint->bInterval, interval);
+
+	djrcv_dev->poll_ep = endpoint;
+	djrcv_dev->poll_interval_orig = endpoint->bInterval;
+	endpoint->bInterval = interval;
+}
+
+static void logi_dj_usb_stop(struct dj_receiver_dev *djrcv_dev)
+{
+	/* Called after hid_hw_stop() */
+	if (!djrcv_dev->poll_ep)
+		return;
+
+	djrcv_dev->poll_ep->bInterval = djrcv_dev->poll_interval_orig;
+	djrcv_dev->poll_ep = NULL;
+}
+
+static int logi_dj_usb_poll_interval(struct dj_receiver_dev *djrcv_dev)
+{
+	struct usb_endpoint_descriptor *endpoint;
+
+	endpoint = logi_dj_usb_in_ep(djrcv_dev->hdev);
+	if (!endpoint)
+		return -ENODEV;
+
+	return endpoint->bInterval;
+}
+
+/* The runtime PM fields of dev_pm_info depend on CONFIG_PM_RUNTIME before
+ * 3.19, which folded it into CONFIG_PM */
+#if defined(CONFIG_PM_RUNTIME) || \
+	(defined(CONFIG_PM) && LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0))
+#define DJ_RUNTIME_PM
+#endif
+
+static void logi_dj_usb_enable_autosuspend(struct dj_receiver_dev *djrcv_dev,
+					   int delay_ms)
+{
+	struct hid_device *hdev = djrcv_dev->hdev;
+	struct usb_interface *intf = to_usb_interface(hdev->dev.parent);
+	struct usb_device *usbdev = interface_to_usbdev(intf);
+
+#ifdef DJ_RUNTIME_PM
+	djrcv_dev->runtime_auto_orig = usbdev->dev.power.runtime_auto;
+	djrcv_dev->autosuspend_delay_orig = usbdev->dev.power.autosuspend_delay;
+	djrcv_dev->autosuspend_set = true;
+#endif
+
+	pm_runtime_set_autosuspend_delay(&usbdev->dev, delay_ms);
+	usb_enable_autosuspend(usbdev);
+}
+
+static void logi_dj_usb_restore_autosuspend(struct dj_receiver_dev *djrcv_dev)
+{
+	/* Gives the device its power policy from before the probe back */
+	struct hid_device *hdev = djrcv_dev->hdev;
+	struct usb_interface *intf = to_usb_interface(hdev->dev.parent);
+	struct usb_device *usbdev = interface_to_usbdev(intf);
+
+	if (!djrcv_dev->autosuspend_set)
+		return;
+
+	pm_runtime_set_autosuspend_delay(&usbdev->dev,
+					 djrcv_dev->autosuspend_delay_orig);
+	if (!djrcv_dev->runtime_auto_orig)
+		usb_disable_autosuspend(usbdev);
+	djrcv_dev->autosuspend_set = false;
+}
+
+static const struct dj_receiver_transport logi_dj_usb_transport = {
+	.name = "usb",
+	.is_dj_interface = logi_dj_usb_is_dj_interface,
+	.make_path = logi_dj_usb_make_path,
+	.has_output_ep = logi_dj_usb_has_output_ep,
+	.start = logi_dj_usb_start,
+	.stop = logi_dj_usb_stop,
+	.poll_interval = logi_dj_usb_poll_interval,
+	.enable_autosuspend = logi_dj_usb_enable_autosuspend,
+	.restore_autosuspend = logi_dj_usb_restore_autosuspend,
+};
+
+static bool logi_dj_generic_is_dj_interface(struct hid_device *hdev)
+{
+	/* Only the DJ interface is expected to be emulated */
+	return true;
+}
+
+static void logi_dj_generic_make_path(struct hid_device *hdev, char *buf,
+				      size_t size)
+{
+	strlcpy(buf, hdev->phys, size);
+}
+
+static bool logi_dj_generic_has_output_ep(struct hid_device *hdev)
+{
+	/* Try output reports first, logi_dj_recv_submit_output() falls back
+	 * to SET_REPORT if the transport does not support them */
+	return true;
+}
+
+/* Receivers not backed by usbhid, e.g. created through uhid */
+static const struct dj_receiver_transport logi_dj_generic_transport = {
+	.name = "generic",
+	.is_dj_interface = logi_dj_generic_is_dj_interface,
+	.make_path = logi_dj_generic_make_path,
+	.has_output_ep = logi_dj_generic_has_output_ep,
+};
+
+static const struct dj_receiver_transport *
+logi_dj_recv_transport(struct hid_device *hdev)
+{
+	struct device *parent = hdev->dev.parent;
+
+	if (parent && parent->bus == &usb_bus_type && parent->type &&
+	    !strcmp(parent->type->name, "usb_interface"))
+		return &logi_dj_usb_transport;
+
+	return &logi_dj_generic_transport;
+}
+
+static void logi_dj_recv_probe_phase(struct dj_receiver_dev *djrcv_dev,
+				     int phase)
+{
+	ktime_t *timing = djrcv_dev->probe_timing;
+
+	timing[phase] = ktime_get();
+	trace_logi_dj_probe_phase(djrcv_dev->hdev, dj_probe_phase_names[phase],
+				  ktime_to_ns(ktime_sub(timing[phase],
+							timing[DJ_PROBE_START])));
+}
+
+static int logi_dj_probe(struct hid_device *hdev,
+			 const struct hid_device_id *id)
+{
+	const struct dj_receiver_transport *transport;
+	struct dj_receiver_dev *djrcv_dev;
+	ktime_t start = ktime_get();
+	int retval;
+
+	transport = logi_dj_recv_transport(hdev);
+	dbg_hid("%s: %s transport\n", __func__, transport->name);
+
+	if (!transport->is_dj_interface(hdev))
+		return -ENODEV;
+
 	/* Treat interface 2 */
 
 	djrcv_dev = kzalloc(sizeof(struct dj_receiver_dev), GFP_KERNEL);
@@ -881,8 +3821,18 @@ static int logi_dj_probe(struct hid_device *hdev,
 		return -ENOMEM;
 	}
 	djrcv_dev->hdev = hdev;
+	djrcv_dev->transport = transport;
+	djrcv_dev->aggregate = aggregate;
+	djrcv_dev->probe_timing[DJ_PROBE_START] = start;
+	kref_init(&djrcv_dev->kref);
 	INIT_WORK(&djrcv_dev->work, delayedwork_callback);
+	INIT_WORK(&djrcv_dev->output_work, logi_dj_recv_output_work);
+	init_waitqueue_head(&djrcv_dev->output_wait);
+	init_waitqueue_head(&djrcv_dev->hidpp_wait);
+	init_waitqueue_head(&djrcv_dev->hidpp_ring_wait);
+	mutex_init(&djrcv_dev->hidpp_mutex);
 	spin_lock_init(&djrcv_dev->lock);
+	spin_lock_init(&djrcv_dev->output_lock);
 	if (kfifo_alloc(&djrcv_dev->notif_fifo,
 			DJ_MAX_NUMBER_NOTIFICATIONS * sizeof(struct dj_report),
 			GFP_KERNEL)) {
@@ -891,6 +3841,19 @@ static int logi_dj_probe(struct hid_device *hdev,
 		kfree(djrcv_dev);
 		return -ENOMEM;
 	}
+	if (logi_dj_recv_alloc_output_fifos(djrcv_dev)) {
+		dev_err(&hdev->dev,
+			"%s:failed allocating output_fifo\n", __func__);
+		kfifo_free(&djrcv_dev->notif_fifo);
+		kfree(djrcv_dev);
+		return -ENOMEM;
+	}
+	/* The ring is a debugging aid, the receiver works without it */
+	retval = logi_dj_recv_alloc_hidpp_ring(djrcv_dev);
+	if (retval)
+		dev_warn(&hdev->dev,
+			 "%s:failed allocating hidpp_ring of %u frames: %d\n",
+			 __func__, hidpp_ring_frames, retval);
 	hid_set_drvdata(hdev, djrcv_dev);
 
 	/* Call  to usbhid to fetch the HID descriptors of interface 2 and
@@ -910,6 +3873,11 @@ static int logi_dj_probe(struct hid_device *hdev,
 		goto hid_parse_fail;
 	}
 
+	logi_dj_recv_probe_phase(djrcv_dev, DJ_PROBE_PARSED);
+
+	if (transport->start)
+		transport->start(djrcv_dev);
+
 	/* Starts the usb device and connects to upper interfaces hiddev and
 	 * hidraw */
 	retval = hid_hw_start(hdev, HID_CONNECT_DEFAULT);
@@ -919,6 +3887,11 @@ static int logi_dj_probe(struct hid_device *hdev,
 		goto hid_hw_start_fail;
 	}
 
+	logi_dj_recv_probe_phase(djrcv_dev, DJ_PROBE_HW_STARTED);
+
+	/* Prefer the interrupt OUT endpoint over control transfers on ep 0 */
+	djrcv_dev->output_ep = transport->has_output_ep(hdev);
+
 	retval = logi_dj_recv_switch_to_dj_mode(djrcv_dev, 0);
 	if (retval < 0) {
 		dev_err(&hdev->dev,
@@ -927,6 +3900,18 @@ static int logi_dj_probe(struct hid_device *hdev,
 		goto switch_to_dj_mode_fail;
 	}
 
+	logi_dj_recv_probe_phase(djrcv_dev, DJ_PROBE_DJ_MODE);
+
+	retval = sysfs_create_group(&hdev->dev.kobj,
+				    &logi_dj_receiver_attr_group);
+	if (retval) {
+		dev_err(&hdev->dev, "%s:failed creating sysfs group\n",
+			__func__);
+		goto sysfs_create_group_fail;
+	}
+
+	logi_dj_recv_create_debugfs(djrcv_dev);
+
 	/* This is enabling the polling urb on the IN endpoint */
 	retval = hid_hw_open(hdev);
 	if (retval < 0) {
@@ -935,6 +3920,8 @@ static int logi_dj_probe(struct hid_device *hdev,
 		goto llopen_failed;
 	}
 
+	logi_dj_recv_probe_phase(djrcv_dev, DJ_PROBE_HW_OPENED);
+
 	/* Allow incoming packets to arrive: */
 	hid_device_io_start(hdev);
 
@@ -945,34 +3932,88 @@ static int logi_dj_probe(struct hid_device *hdev,
 		goto logi_dj_recv_query_paired_devices_failed;
 	}
 
+	logi_dj_recv_probe_phase(djrcv_dev, DJ_PROBE_QUERIED);
+
+	if (autosuspend_delay_ms >= 0 && transport->enable_autosuspend)
+		transport->enable_autosuspend(djrcv_dev, autosuspend_delay_ms);
+
 	return retval;
 
 logi_dj_recv_query_paired_devices_failed:
 	hid_hw_close(hdev);
 
 llopen_failed:
+	logi_dj_recv_remove_debugfs(djrcv_dev);
+	sysfs_remove_group(&hdev->dev.kobj, &logi_dj_receiver_attr_group);
+
+sysfs_create_group_fail:
 switch_to_dj_mode_fail:
 	hid_hw_stop(hdev);
 
 hid_hw_start_fail:
+	if (transport->stop)
+		transport->stop(djrcv_dev);
+
 hid_parse_fail:
+	logi_dj_recv_free_output_fifos(djrcv_dev);
 	kfifo_free(&djrcv_dev->notif_fifo);
-	kfree(djrcv_dev);
 	hid_set_drvdata(hdev, NULL);
+	logi_dj_recv_put(djrcv_dev);
 	return retval;
 
 }
 
 #ifdef CONFIG_PM
+static int logi_dj_resume(struct hid_device *hdev)
+{
+	/* Also called on runtime resume: the devices kept their link and
+	 * settings, leave them alone */
+	struct dj_receiver_dev *djrcv_dev = hid_get_drvdata(hdev);
+	unsigned long flags;
+
+	/* Used to measure the wake to first report latency */
+	spin_lock_irqsave(&djrcv_dev->lock, flags);
+	djrcv_dev->resume_time = ktime_get();
+	spin_unlock_irqrestore(&djrcv_dev->lock, flags);
+
+	return 0;
+}
+
 static int logi_dj_reset_resume(struct hid_device *hdev)
 {
 	int retval;
 	struct dj_receiver_dev *djrcv_dev = hid_get_drvdata(hdev);
+	struct dj_device *dj_dev;
+	struct dj_report dj_report;
+	unsigned long flags;
+	int i;
 
-	retval = logi_dj_recv_switch_to_dj_mode(djrcv_dev, 0);
+	logi_dj_resume(hdev);
+
+	/* The link notifications sent meanwhile are lost and the devices
+	 * may have been powered down. Their next connection will restore
+	 * their settings */
+	spin_lock_irqsave(&djrcv_dev->lock, flags);
+	for (i = DJ_DEVICE_INDEX_MIN; i <= DJ_DEVICE_INDEX_MAX; i++) {
+		dj_dev = djrcv_dev->paired_dj_devices[i];
+		if (!dj_dev)
+			continue;
+
+		dj_dev->link_state = DJ_LINK_UNKNOWN;
+		dj_dev->link_changed = djrcv_dev->resume_time;
+		dj_dev->hires_stale = true;
+	}
+	spin_unlock_irqrestore(&djrcv_dev->lock, flags);
+
+	/* Only queue the command: on a runtime resume, the output work
+	 * resuming the receiver would wait for us, so it can not be flushed
+	 * here. It is sent once the resume completes */
+	logi_dj_recv_init_switch_report(&dj_report, 0);
+	retval = logi_dj_recv_queue_output(djrcv_dev, (u8 *)&dj_report,
+					   DJREPORT_SHORT_LENGTH);
 	if (retval < 0) {
 		dev_err(&hdev->dev,
-			"%s:logi_dj_recv_switch_to_dj_mode returned error:%d\n",
+			"%s:logi_dj_recv_queue_output returned error:%d\n",
 			__func__, retval);
 	}
 
@@ -990,9 +4031,6 @@ static void logi_dj_remove(struct hid_device *hdev)
 
 	cancel_work_sync(&djrcv_dev->work);
 
-	hid_hw_close(hdev);
-	hid_hw_stop(hdev);
-
 	/* I suppose that at this point the only context that can access
 	 * the djrecv_data is this thread as the work item is guaranteed to
 	 * have finished and no more raw_event callbacks should arrive after
@@ -1001,15 +4039,33 @@ static void logi_dj_remove(struct hid_device *hdev)
 	for (i = 0; i < (DJ_MAX_PAIRED_DEVICES + DJ_DEVICE_INDEX_MIN); i++) {
 		dj_dev = djrcv_dev->paired_dj_devices[i];
 		if (dj_dev != NULL) {
-			hid_destroy_device(dj_dev->hdev);
-			kfree(dj_dev);
+			logi_dj_recv_free_djhid_device(dj_dev);
 			djrcv_dev->paired_dj_devices[i] = NULL;
 		}
 	}
+	logi_dj_recv_free_aggregates(djrcv_dev);
+
+	/* The children are gone, nobody can queue outputs anymore */
+	cancel_work_sync(&djrcv_dev->output_work);
+
+	sysfs_remove_group(&hdev->dev.kobj, &logi_dj_receiver_attr_group);
+
+	hid_hw_close(hdev);
+	hid_hw_stop(hdev);
 
+	/* No more raw events, nothing writes to the capture channel */
+	logi_dj_recv_remove_debugfs(djrcv_dev);
+
+	if (djrcv_dev->transport->restore_autosuspend)
+		djrcv_dev->transport->restore_autosuspend(djrcv_dev);
+	if (djrcv_dev->transport->stop)
+		djrcv_dev->transport->stop(djrcv_dev);
+	logi_dj_recv_free_output_fifos(djrcv_dev);
 	kfifo_free(&djrcv_dev->notif_fifo);
-	kfree(djrcv_dev);
 	hid_set_drvdata(hdev, NULL);
+
+	/* The ring and djrcv_dev stay until the debugfs files are closed */
+	logi_dj_recv_put(djrcv_dev);
 }
 
 static const struct hid_device_id logi_dj_receivers[] = {
@@ -1029,6 +4085,7 @@ static struct hid_driver logi_djreceiver_driver = {
 	.remove = logi_dj_remove,
 	.raw_event = logi_dj_raw_event,
 #ifdef CONFIG_PM
+	.resume = logi_dj_resume,
 	.reset_resume = logi_dj_reset_resume,
 #endif
 };
@@ -1052,14 +4109,22 @@ static int __init logi_dj_init(void)
 
 	dbg_hid("Logitech-DJ:%s\n", __func__);
 
+	logi_dj_debugfs_root = debugfs_create_dir("hid-logitech-dj", NULL);
+
 	retval = hid_register_driver(&logi_djreceiver_driver);
 	if (retval)
-		return retval;
+		goto register_receiver_fail;
 
 	retval = hid_register_driver(&logi_djdevice_driver);
 	if (retval)
-		hid_unregister_driver(&logi_djreceiver_driver);
+		goto register_device_fail;
+
+	return 0;
 
+register_device_fail:
+	hid_unregister_driver(&logi_djreceiver_driver);
+register_receiver_fail:
+	debugfs_remove_recursive(logi_dj_debugfs_root);
 	return retval;
 
 }
@@ -1070,6 +4135,7 @@ static void __exit logi_dj_exit(void)
 
 	hid_unregister_driver(&logi_djdevice_driver);
 	hid_unregister_driver(&logi_djreceiver_driver);
+	debugfs_remove_recursive(logi_dj_debugfs_root);
 
 }
 
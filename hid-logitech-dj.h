@@ -24,6 +24,7 @@
  */
 
 #include <linux/kfifo.h>
+#include <linux/kref.h>
 
 #ifndef HID_GROUP_LOGITECH_DJ_DEVICE_GENERIC
 #define HID_GROUP_LOGITECH_DJ_DEVICE_GENERIC	0x0005
@@ -32,6 +33,8 @@
 
 #define DJ_MAX_PAIRED_DEVICES			6
 #define DJ_MAX_NUMBER_NOTIFICATIONS		8
+#define DJ_MAX_NUMBER_OUTPUTS			4
+#define DJ_OUTPUT_TIMEOUT_MS			500
 #define DJ_DEVICE_INDEX_MIN 			1
 #define DJ_DEVICE_INDEX_MAX 			6
 
@@ -47,6 +50,49 @@
 #define HIDPP_REPORT_SHORT_LENGTH		7
 #define HIDPP_REPORT_LONG_LENGTH		20
 
+#define DJ_HIDPP_TIMEOUT_MS			500
+
+/* HID++ 1.0 register access, device index 0xFF is the receiver itself */
+#define HIDPP_RECEIVER_INDEX			0xFF
+#define HIDPP_GET_LONG_REGISTER			0x83
+#define HIDPP_ERROR				0x8F
+#define HIDPP20_ERROR				0xFF
+
+/* Pairing information register, the parameter is base + device index - 1 */
+#define HIDPP_REG_PAIRING_INFORMATION		0xB5
+#define HIDPP_EXTENDED_PAIRING			0x30
+#define HIDPP_DEVICE_NAME			0x40
+#define HIDPP_EXTENDED_PAIRING_SERIAL		5
+#define HIDPP_DEVICE_NAME_LENGTH		5
+#define HIDPP_DEVICE_NAME_STRING		6
+#define HIDPP_DEVICE_NAME_MAX			(HIDPP_REPORT_LONG_LENGTH - \
+						 HIDPP_DEVICE_NAME_STRING)
+
+/* HID++ 2.0 feature access: feature index, function << 4 | software id,
+ * then the parameters. Feature 0 is the root feature */
+#define HIDPP20_SWID				0x01
+#define HIDPP20_ROOT_INDEX			0x00
+#define HIDPP20_ROOT_GET_FEATURE		0x00
+#define HIDPP20_PARAMS				4
+
+/* High resolution wheel feature */
+#define HIDPP20_FEATURE_HIRES_WHEEL		0x2121
+#define HIDPP20_HIRES_WHEEL_GET_CAPABILITY	0x00
+#define HIDPP20_HIRES_WHEEL_SET_MODE		0x02
+#define HIDPP20_HIRES_WHEEL_MODE_HIRES		0x02	/* HID target */
+
+/* Adjustable report rate feature, rates being report intervals in ms.
+ * The list is a bitfield, bit n set meaning n + 1 ms is supported */
+#define HIDPP20_FEATURE_REPORT_RATE		0x8060
+#define HIDPP20_REPORT_RATE_GET_LIST		0x00
+#define HIDPP20_REPORT_RATE_GET			0x01
+#define HIDPP20_REPORT_RATE_SET			0x02
+
+#ifndef REL_WHEEL_HI_RES
+#define REL_WHEEL_HI_RES			0x0b
+#endif
+#define DJ_WHEEL_HI_RES_UNIT			120	/* per wheel detent */
+
 #define REPORT_TYPE_RFREPORT_FIRST		0x01
 #define REPORT_TYPE_RFREPORT_LAST		0x1F
 
@@ -77,6 +123,11 @@
 #define CONNECTION_STATUS_PARAM_STATUS		0x00
 #define STATUS_LINKLOSS				0x01
 
+/* Link state of a paired device, as exported in sysfs */
+#define DJ_LINK_UNKNOWN				0x00
+#define DJ_LINK_CONNECTED			0x01
+#define DJ_LINK_DISCONNECTED			0x02
+
 /* Error Notification */
 #define REPORT_TYPE_NOTIF_ERROR			0x7F
 #define NOTIF_ERROR_PARAM_ETYPE			0x00
@@ -90,6 +141,29 @@
 #define REPORT_TYPE_MEDIA_CENTER		0x08
 #define REPORT_TYPE_LEDS			0x0E
 
+/* Maximum size of all defined hid reports in bytes (including report id) */
+#define MAX_REPORT_SIZE 8
+
+/* Standard keyboard report layout (see kbd_descriptor) */
+#define KBD_REPORT_MODIFIERS			1
+#define KBD_REPORT_KEYS				2
+#define KBD_KEYS_COUNT				6
+#define KBD_USAGE_ERROR_ROLLOVER		0x01
+#define KBD_USAGE_LEFT_CONTROL			0xE0
+/* The 8 modifier usages in a bitmap of usages */
+#define KBD_MODIFIERS_WORD			BIT_WORD(KBD_USAGE_LEFT_CONTROL)
+#define KBD_MODIFIERS_MASK			(0xFFUL << (KBD_USAGE_LEFT_CONTROL \
+						 % BITS_PER_LONG))
+#define KBD_USAGES_COUNT			256
+#define KBD_LEDS_MASK				0x1F
+
+/* Standard mouse report layout (see mse_descriptor) */
+#define MOUSE_REPORT_BUTTONS			1
+#define MOUSE_REPORT_XY				3
+#define MOUSE_REPORT_WHEEL			6
+#define MOUSE_REPORT_AC_PAN			7
+#define MOUSE_BUTTONS_COUNT			16
+
 /* RF Report types bitfield */
 #define STD_KEYBOARD				0x00000002
 #define STD_MOUSE				0x00000004
@@ -105,14 +179,258 @@ struct dj_report {
 	u8 report_params[DJREPORT_SHORT_LENGTH - 3];
 };
 
+/* HID++ request sent by the driver and its answer */
+struct dj_hidpp_query {
+	u8 request[HIDPP_REPORT_SHORT_LENGTH];
+	u8 response[HIDPP_REPORT_LONG_LENGTH];
+	unsigned int match_size;	/* bytes of request to match after id */
+	int status;			/* 0, -EIO on error, -ETIMEDOUT */
+};
+
+/* HID++ requests issued by a child device and awaiting an answer, used to
+ * route the answer to that child only (hidpp_routing) */
+#define DJ_HIDPP_MAX_REQUESTS		4
+
+/* HID++ frames ring (hidpp_ring_frames), mmap()ed from debugfs at
+ * hid-logitech-dj/<receiver>/hidpp_ring. The first page holds the header,
+ * the frames follow it. nr_frames is a power of two and head and tail are
+ * free running: frame n is at index n & (nr_frames - 1).
+ *
+ * The driver is the only writer of head and overflows, the reader the only
+ * writer of tail, which it advances after consuming frames. Frames are
+ * written before head is updated. When head - tail == nr_frames the ring
+ * is full and new frames are dropped and counted in overflows. poll()
+ * reports POLLIN while head != tail. The ring is reset on open() and only
+ * one reader is allowed at a time. */
+#define DJ_HIDPP_RING_VERSION		1
+#define DJ_HIDPP_RING_MAX_FRAMES	(1 << 20)
+
+struct dj_hidpp_ring_header {
+	__u32 version;
+	__u32 nr_frames;
+	__u32 frame_size;		/* sizeof(struct dj_hidpp_ring_frame) */
+	__u32 head;
+	__u32 tail;
+	__u32 overflows;
+};
+
+struct dj_hidpp_ring_frame {
+	__u64 timestamp_ns;		/* CLOCK_MONOTONIC arrival time */
+	__u8 size;
+	__u8 data[HIDPP_REPORT_LONG_LENGTH];	/* report id included */
+	__u8 reserved[3];
+};
+
+/* Capture of the receiver traffic (capture_kb), written while capture_enable
+ * is set in debugfs at hid-logitech-dj/<receiver>/. The records go to the
+ * per cpu relay files capture0, capture1... in flight recorder mode: when
+ * full, the oldest sub-buffer is overwritten. Records never straddle two
+ * sub-buffers, and merging the files by timestamp gives the whole trace.
+ *
+ * Input records hold the report as received by raw_event, before any
+ * rewrite, and the routing decision. Output records hold the report as
+ * sent to the receiver. */
+#define DJ_CAPTURE_DATA_MAX			DJREPORT_LONG_LENGTH
+
+#define DJ_CAPTURE_IN				0
+#define DJ_CAPTURE_OUT				1
+
+#define DJ_CAPTURE_ROUTE_NONE			0	/* output reports */
+#define DJ_CAPTURE_ROUTE_DRIVER			1	/* consumed by the driver */
+#define DJ_CAPTURE_ROUTE_DEVICE			2	/* paired device only */
+#define DJ_CAPTURE_ROUTE_RECEIVER		3	/* receiver hidraw, and
+							 * paired device when
+							 * HID++ is broadcast */
+#define DJ_CAPTURE_ROUTE_DROPPED		4	/* report filter */
+
+struct dj_capture_record {
+	__u64 timestamp_ns;		/* CLOCK_MONOTONIC */
+	__u8 direction;
+	__u8 route;
+	__u8 size;			/* of the report, data may be shorter */
+	__u8 reserved[5];
+	__u8 data[DJ_CAPTURE_DATA_MAX];	/* report id included */
+};
+
+/* Histogram of the time between two consecutive input reports of a device
+ * index, bucket n counting the intervals in [2^(n - 1), 2^n) ns */
+#define DJ_INTERVAL_BUCKETS			64
+
+struct dj_interval_histogram {
+	s64 last_ns;
+	u32 buckets[DJ_INTERVAL_BUCKETS];
+};
+
+/* Phases of logi_dj_probe(), timestamped when they complete */
+#define DJ_PROBE_START				0
+#define DJ_PROBE_PARSED				1
+#define DJ_PROBE_HW_STARTED			2
+#define DJ_PROBE_DJ_MODE			3
+#define DJ_PROBE_HW_OPENED			4
+#define DJ_PROBE_QUERIED			5
+#define DJ_PROBE_PHASES				6
+
+/* Phases of the creation of a paired device, from the scheduling of the
+ * work handling its pairing notification */
+#define DJ_ADD_QUEUED				0
+#define DJ_ADD_STARTED				1
+#define DJ_ADD_PAIRING_INFO			2
+#define DJ_ADD_HID_ADDED			3
+#define DJ_ADD_DONE				4
+#define DJ_ADD_PHASES				5
+
+/* Name and serial of a paired device, read from the receiver */
+struct dj_pairing_info {
+	char name[HIDPP_DEVICE_NAME_MAX + 1];
+	u32 serial;
+	bool has_name;
+	bool has_serial;
+	bool valid;
+};
+
+/* Per device filter applied to the DJ input reports before forwarding:
+ * whole report types can be dropped, keyboard usages and mouse buttons
+ * remapped (a 0 target drops the key or button) */
+struct dj_report_filter {
+	u32 drop_types;
+	u8 key_remap[KBD_USAGES_COUNT];
+	u8 button_remap[MOUSE_BUTTONS_COUNT];	/* 1 based, 0 drops */
+};
+
+/* Raw output report (report id included) waiting to be sent to the receiver */
+struct dj_output_report {
+	u8 size;
+	u8 data[HIDPP_REPORT_LONG_LENGTH];
+};
+
+/* Classes of reports (aggregate) combines, one aggregate device each */
+#define DJ_AGGREGATE_KEYBOARD		0
+#define DJ_AGGREGATE_MOUSE		1
+#define DJ_AGGREGATE_CONSUMER		2
+#define DJ_AGGREGATE_SYSTEM		3
+#define DJ_AGGREGATE_MEDIA_CENTER	4
+#define DJ_AGGREGATE_CLASSES		5
+
+/* Files of the receiver's debugfs directory, besides the relay ones */
+#define DJ_DEBUGFS_FILES	4
+
+struct dj_receiver_dev;
+
+/* What depends on how the receiver is connected: usbhid for the real
+ * receivers, anything else (e.g. uhid) for the generic transport. The
+ * ops after has_output_ep are optional */
+struct dj_receiver_transport {
+	const char *name;
+	bool (*is_dj_interface)(struct hid_device *hdev);
+	void (*make_path)(struct hid_device *hdev, char *buf, size_t size);
+	bool (*has_output_ep)(struct hid_device *hdev);
+	void (*start)(struct dj_receiver_dev *djrcv_dev);
+	void (*stop)(struct dj_receiver_dev *djrcv_dev);
+	int (*poll_interval)(struct dj_receiver_dev *djrcv_dev);
+	void (*enable_autosuspend)(struct dj_receiver_dev *djrcv_dev,
+				   int delay_ms);
+	void (*restore_autosuspend)(struct dj_receiver_dev *djrcv_dev);
+};
+
 struct dj_receiver_dev {
 	struct hid_device *hdev;
+	const struct dj_receiver_transport *transport;
 	struct dj_device *paired_dj_devices[DJ_MAX_PAIRED_DEVICES +
 					    DJ_DEVICE_INDEX_MIN];
 	struct work_struct work;
 	struct kfifo notif_fifo;
 	spinlock_t lock;
+	/* Indexes whose link_state changed, for the work to notify them.
+	 * Atomic bitops */
+	unsigned long link_changes;
 	bool querying_devices;
+
+	/* Output multiplexer: one bounded fifo per device index (0 is used
+	 * for the receiver itself), drained by logi_dj_recv_output_work() */
+	struct work_struct output_work;
+	struct kfifo output_fifo[DJ_MAX_PAIRED_DEVICES + DJ_DEVICE_INDEX_MIN];
+	wait_queue_head_t output_wait;
+	spinlock_t output_lock;
+	unsigned int output_next;
+	bool output_ep;
+
+	/* HID++ queries issued by the driver, one batch at a time. The
+	 * queries array and counters are protected by lock */
+	struct mutex hidpp_mutex;
+	wait_queue_head_t hidpp_wait;
+	struct dj_hidpp_query *hidpp_queries;
+	int hidpp_nqueries;
+	int hidpp_pending;
+	struct dj_pairing_info pairing_info[DJ_MAX_PAIRED_DEVICES +
+					    DJ_DEVICE_INDEX_MIN];
+
+	/* Runtime PM statistics, protected by lock */
+	ktime_t resume_time;
+	ktime_t wake_latency;
+
+	/* Copies of HID++ reports given to or withheld from the receiver
+	 * and child nodes, protected by lock */
+	unsigned long hidpp_delivered;
+	unsigned long hidpp_suppressed;
+
+	/* HID++ frames ring, see struct dj_hidpp_ring_header. head is kept
+	 * here as the shared copy may be overwritten by userspace. Protected
+	 * by lock */
+	struct dj_hidpp_ring_header *hidpp_ring;
+	struct dj_hidpp_ring_frame *hidpp_ring_frames;
+	unsigned long hidpp_ring_size;
+	u32 hidpp_ring_nr;
+	u32 hidpp_ring_head;
+	bool hidpp_ring_open;
+	wait_queue_head_t hidpp_ring_wait;
+
+	/* Held by the driver until removal and by every open debugfs file,
+	 * which may outlive the removal. The files are listed to be revoked
+	 * before they are removed */
+	struct kref kref;
+	struct dentry *debugfs_dir;
+	struct dentry *debugfs_files[DJ_DEBUGFS_FILES];
+	int debugfs_nfiles;
+
+	/* Input report intervals per device index, updated from raw_event
+	 * only and read locklessly from debugfs */
+	struct dj_interval_histogram intervals[DJ_MAX_PAIRED_DEVICES +
+					       DJ_DEVICE_INDEX_MIN];
+
+	/* Bring-up timing, see DJ_PROBE_* and DJ_ADD_*. work_queued is the
+	 * last time the work was scheduled (protected by lock), notif_queued
+	 * and notif_started the scheduling and start of the current run */
+	ktime_t probe_timing[DJ_PROBE_PHASES];
+	ktime_t add_timing[DJ_MAX_PAIRED_DEVICES + DJ_DEVICE_INDEX_MIN]
+			  [DJ_ADD_PHASES];
+	ktime_t work_queued;
+	ktime_t notif_queued;
+	ktime_t notif_started;
+
+	/* Traffic capture, see struct dj_capture_record */
+	struct rchan *capture_chan;
+	u32 capture_enabled;
+
+	/* Aggregate mode, chosen at probe: the devices share one aggregate
+	 * device per class of reports (DJ_AGGREGATE_*), created along with
+	 * the first device having that class and kept until removal.
+	 * aggregate_devs is protected by lock. aggregate_kbd_slots holds the
+	 * indexes of the aggregated keyboards, updated in work context with
+	 * atomic bitops */
+	bool aggregate;
+	struct dj_device *aggregate_devs[DJ_AGGREGATE_CLASSES];
+	unsigned long aggregate_kbd_slots;
+
+	/* USB transport: IN endpoint whose bInterval was overridden
+	 * (poll_intervals) and its original value, restored on removal */
+	struct usb_endpoint_descriptor *poll_ep;
+	u8 poll_interval_orig;
+
+	/* USB transport: power policy of the device before
+	 * autosuspend_delay_ms was applied, restored on removal */
+	bool autosuspend_set;
+	bool runtime_auto_orig;
+	int autosuspend_delay_orig;
 };
 
 struct dj_device {
@@ -120,6 +438,65 @@ struct dj_device {
 	struct dj_receiver_dev *dj_receiver_dev;
 	u32 reports_supported;
 	u8 device_index;
+	u16 wpid;
+	char name[HIDPP_DEVICE_NAME_MAX + 1];
+
+	/* The reports go to the receiver's aggregate devices, hdev is NULL */
+	bool aggregated;
+
+	/* Input device fed directly by the driver, bypassing hid-core for
+	 * the standard mouse reports (mouse_fastpath) */
+	struct input_dev *mouse_input;
+
+	/* Wheel units per detent while the mouse is in high resolution mode,
+	 * 0 otherwise, and the units not reported yet as REL_WHEEL.
+	 * hires_stale is set when the mode may have been lost (link loss,
+	 * reset of the receiver): the multiplier is kept until the mode is
+	 * enabled again or that fails. Protected by the receiver lock */
+	u8 hires_multiplier;
+	int hires_remainder;
+	bool hires_stale;
+
+	/* Report interval in ms chosen through sysfs, 0 if none, restored
+	 * whenever the device connects again. report_rates caches the
+	 * supported intervals (bit n for n + 1 ms) and the HID++ index of the
+	 * feature once queried, 0 before */
+	u8 report_rate_ms;
+	u8 report_rates;
+	u8 report_rate_index;
+
+	/* Same for the standard keyboard reports (kbd_fastpath), kbd_keys
+	 * holds the usages currently pressed */
+	struct input_dev *kbd_input;
+	DECLARE_BITMAP(kbd_keys, KBD_USAGES_COUNT);
+
+	/* Protected by dj_receiver_dev->lock */
+	u8 link_state;
+	ktime_t link_changed;
+
+	/* HID++ routing (hidpp_routing): sub id and address of the pending
+	 * requests of this device, oldest first, and whether it wants all the
+	 * HID++ reports of its index. Protected by the receiver lock */
+	u8 hidpp_requests[DJ_HIDPP_MAX_REQUESTS][2];
+	unsigned int hidpp_nrequests;
+	bool hidpp_subscribed;
+
+	/* Allocated on first use from sysfs, never replaced afterwards */
+	struct dj_report_filter *filter;
+
+	/* Last stateful reports received, indexed by report type, to drop
+	 * identical repeats (suppress_repeats). Protected by the receiver
+	 * lock */
+	u8 last_reports[REPORT_TYPE_MEDIA_CENTER + 1][MAX_REPORT_SIZE];
+	u16 last_reports_valid;
+	unsigned long suppressed_reports;
+
+	/* Time between the arrival of an input report in raw_event and its
+	 * delivery to the input layer. Protected by the receiver lock */
+	s64 delivery_latency_last;
+	s64 delivery_latency_max;
+	s64 delivery_latency_sum;
+	u64 delivery_count;
 };
 
 #endif